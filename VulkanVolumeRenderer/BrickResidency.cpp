@@ -0,0 +1,280 @@
+#include "BrickResidency.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "Parallel.hpp"
+#include "utility.hpp"
+
+// private
+
+void BrickResidency::prepareAtlas() {
+	VkFormat format = VK_FORMAT_R8G8B8A8_UNORM;
+	glm::uvec3 extent = brickTree != nullptr ? atlasBricks * datastructure::BRICK_ATLAS_SIZE : glm::uvec3(1);
+
+	VkImageCreateInfo imageCreateInfo = vkTools::initializers::imageCreateInfo();
+	imageCreateInfo.imageType = VK_IMAGE_TYPE_3D;
+	imageCreateInfo.format = format;
+	imageCreateInfo.extent = { extent.x, extent.y, extent.z };
+	imageCreateInfo.mipLevels = 1;
+	imageCreateInfo.arrayLayers = 1;
+	imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+	imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+	imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	imageCreateInfo.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+	imageCreateInfo.flags = 0;
+
+	atlas.width = extent.x;
+	atlas.height = extent.y;
+	atlas.mipLevels = 1;
+	atlas.layerCount = 1;
+	VK_CHECK_RESULT(vkCreateImage(vulkanDevice->logicalDevice, &imageCreateInfo, nullptr, &atlas.image));
+	VK_CHECK_RESULT(vulkanDevice->allocateImageMemory(atlas.image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &atlas.allocation));
+	atlas.deviceMemory = atlas.allocation.memory;
+
+	// empty slots are transparent
+	VkCommandBuffer clearCmd = util::createCommandBuffer(vulkanDevice->logicalDevice, commandPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+	vkTools::setImageLayout(
+		clearCmd,
+		atlas.image,
+		VK_IMAGE_ASPECT_COLOR_BIT,
+		VK_IMAGE_LAYOUT_UNDEFINED,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+	VkClearColorValue clearColor = {};
+	VkImageSubresourceRange subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+	vkCmdClearColorImage(clearCmd, atlas.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &clearColor, 1, &subresourceRange);
+	atlas.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	vkTools::setImageLayout(
+		clearCmd,
+		atlas.image,
+		VK_IMAGE_ASPECT_COLOR_BIT,
+		VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		atlas.imageLayout);
+	util::flushCommandBuffer(vulkanDevice->logicalDevice, commandPool, clearCmd, queue, true);
+
+	// the apron of every brick makes filtering at the brick borders exact, clamping only matters for the edge of the atlas
+	VkSamplerCreateInfo sampler = vkTools::initializers::samplerCreateInfo();
+	sampler.magFilter = VK_FILTER_LINEAR;
+	sampler.minFilter = VK_FILTER_LINEAR;
+	sampler.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	sampler.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	sampler.addressModeV = sampler.addressModeU;
+	sampler.addressModeW = sampler.addressModeU;
+	sampler.mipLodBias = 0.0f;
+	sampler.maxAnisotropy = 0;
+	sampler.compareOp = VK_COMPARE_OP_NEVER;
+	sampler.minLod = 0.0f;
+	sampler.maxLod = 0.0f;
+	sampler.borderColor = VK_BORDER_COLOR_FLOAT_TRANSPARENT_BLACK;
+	VK_CHECK_RESULT(vkCreateSampler(vulkanDevice->logicalDevice, &sampler, nullptr, &atlas.sampler));
+
+	VkImageViewCreateInfo view = vkTools::initializers::imageViewCreateInfo();
+	view.viewType = VK_IMAGE_VIEW_TYPE_3D;
+	view.format = format;
+	view.components = { VK_COMPONENT_SWIZZLE_R, VK_COMPONENT_SWIZZLE_G, VK_COMPONENT_SWIZZLE_B, VK_COMPONENT_SWIZZLE_A };
+	view.subresourceRange = subresourceRange;
+	view.image = atlas.image;
+	VK_CHECK_RESULT(vkCreateImageView(vulkanDevice->logicalDevice, &view, nullptr, &atlas.view));
+
+	atlas.descriptor.imageLayout = atlas.imageLayout;
+	atlas.descriptor.imageView = atlas.view;
+	atlas.descriptor.sampler = atlas.sampler;
+}
+
+// public
+
+BrickResidency::BrickResidency(vk::VulkanDevice *vulkanDevice, const datastructure::BrickTree *brickTree, const datastructure::Node *sourceNodes, VkDeviceSize poolSize, uint32_t numFrames, uint32_t maxLoadsPerFrame, uint32_t numThreads) {
+	this->vulkanDevice = vulkanDevice;
+	this->brickTree = brickTree;
+	this->sourceNodes = sourceNodes;
+	this->maxLoadsPerFrame = maxLoadsPerFrame;
+	this->numThreads = numThreads;
+
+	vkGetDeviceQueue(vulkanDevice->logicalDevice, vulkanDevice->queueFamilyIndices.compute, vulkanDevice->computeQueueIndex, &queue);
+	commandPool = vulkanDevice->createCommandPool(vulkanDevice->queueFamilyIndices.compute);
+	commandBuffer = util::createCommandBuffer(vulkanDevice->logicalDevice, commandPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, false);
+
+	uint32_t numBricks = 0;
+	if (brickTree != nullptr) {
+		// the atlas is filled as a cube of slots, limited by the pool size and the maximum image extent
+		VkDeviceSize brickBytes = datastructure::BRICK_ATLAS_TEXELS * sizeof(uint32_t);
+		uint32_t maxSlotsPerSide = vulkanDevice->properties.limits.maxImageDimension3D / datastructure::BRICK_ATLAS_SIZE;
+		numBricks = brickTree->numBricks();
+		VkDeviceSize maxSlots = VkDeviceSize(maxSlotsPerSide) * maxSlotsPerSide * maxSlotsPerSide;
+		numSlots = uint32_t(std::min({ VkDeviceSize(numBricks), poolSize / brickBytes, maxSlots }));
+		numSlots = std::max(numSlots, 1u);
+		uint32_t slotsPerSide = std::min(maxSlotsPerSide, uint32_t(std::ceil(std::cbrt(double(numSlots)))));
+		atlasBricks = glm::uvec3(slotsPerSide, slotsPerSide, (numSlots + slotsPerSide * slotsPerSide - 1) / (slotsPerSide * slotsPerSide));
+
+		slotBricks.assign(numSlots, UINT32_MAX);
+		// slots are handed out from the back, so the first loads fill the atlas front to back
+		for (uint32_t slot = numSlots; slot > 0; slot--) {
+			freeSlots.push_back(slot - 1);
+		}
+		VK_CHECK_RESULT(vulkanDevice->createBuffer(
+			VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			&staging,
+			VkDeviceSize(maxLoadsPerFrame) * brickBytes));
+		VK_CHECK_RESULT(staging.map());
+		std::cout << "Brick pool: " << numSlots << " of " << numBricks << " bricks, atlas " << atlasBricks.x * datastructure::BRICK_ATLAS_SIZE << "x"
+			<< atlasBricks.y * datastructure::BRICK_ATLAS_SIZE << "x" << atlasBricks.z * datastructure::BRICK_ATLAS_SIZE << " (" << numSlots * brickBytes / 1000000.0f << " MB)" << std::endl;
+	}
+	prepareAtlas();
+
+	// the tables are written by the host between frames and stay mapped
+	std::vector<uint32_t> emptySlots(std::max(numBricks, 1u), 0);
+	VK_CHECK_RESULT(vulkanDevice->createBuffer(
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		&slotTable,
+		emptySlots.size() * sizeof(uint32_t),
+		emptySlots.data()));
+	VK_CHECK_RESULT(slotTable.map());
+	std::vector<uint32_t> emptyFeedback(1 + MAX_BRICK_REQUESTS + numSlots, 0);
+	feedback.resize(numFrames);
+	for (vk::Buffer& frameFeedback : feedback) {
+		VK_CHECK_RESULT(vulkanDevice->createBuffer(
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			&frameFeedback,
+			emptyFeedback.size() * sizeof(uint32_t),
+			emptyFeedback.data()));
+		VK_CHECK_RESULT(frameFeedback.map());
+	}
+}
+
+BrickResidency::~BrickResidency() {
+	vkQueueWaitIdle(queue);
+	vkDestroyImageView(vulkanDevice->logicalDevice, atlas.view, nullptr);
+	vkDestroyImage(vulkanDevice->logicalDevice, atlas.image, nullptr);
+	vkDestroySampler(vulkanDevice->logicalDevice, atlas.sampler, nullptr);
+	vulkanDevice->allocator->free(atlas.allocation);
+	slotTable.unmap();
+	slotTable.destroy();
+	for (vk::Buffer& frameFeedback : feedback) {
+		frameFeedback.unmap();
+		frameFeedback.destroy();
+	}
+	if (brickTree != nullptr) {
+		staging.unmap();
+		staging.destroy();
+	}
+	vkDestroyCommandPool(vulkanDevice->logicalDevice, commandPool, nullptr);
+}
+
+bool BrickResidency::hasRequests(uint32_t frameIndex) const {
+	return brickTree != nullptr && static_cast<const uint32_t*>(feedback[frameIndex].mapped)[0] > 0;
+}
+
+void BrickResidency::update(uint32_t frame) {
+	loadedBricks = 0;
+	if (brickTree == nullptr) {
+		return;
+	}
+	uint32_t *brickSlots = static_cast<uint32_t*>(slotTable.mapped);
+
+	// every ray that misses a brick reports it, so the requests contain duplicates
+	std::vector<uint32_t> requests;
+	for (vk::Buffer& frameFeedback : feedback) {
+		uint32_t *feedbackWords = static_cast<uint32_t*>(frameFeedback.mapped);
+		requests.insert(requests.end(), feedbackWords + 1, feedbackWords + 1 + std::min(feedbackWords[0], MAX_BRICK_REQUESTS));
+		feedbackWords[0] = 0;
+	}
+	std::sort(requests.begin(), requests.end());
+	requests.erase(std::unique(requests.begin(), requests.end()), requests.end());
+	requests.erase(std::remove_if(requests.begin(), requests.end(), [&](uint32_t brick) { return brickSlots[brick] != 0; }), requests.end());
+	if (requests.size() > maxLoadsPerFrame) {
+		requests.resize(maxLoadsPerFrame);
+	}
+	if (requests.empty()) {
+		return;
+	}
+
+	// bricks sampled by the last frame stay, the others are evicted in the order they were last used
+	if (requests.size() > freeSlots.size()) {
+		// one read of the mapped stamps, the sort compares them repeatedly; a slot was last used by the latest frame
+		// that stamped it
+		std::vector<uint32_t> lastUsed(numSlots, 0);
+		for (vk::Buffer& frameFeedback : feedback) {
+			const uint32_t *slotFrames = static_cast<const uint32_t*>(frameFeedback.mapped) + 1 + MAX_BRICK_REQUESTS;
+			for (uint32_t slot = 0; slot < numSlots; slot++) {
+				lastUsed[slot] = std::max(lastUsed[slot], slotFrames[slot]);
+			}
+		}
+		std::vector<uint32_t> candidates;
+		for (uint32_t slot = 0; slot < numSlots; slot++) {
+			if (slotBricks[slot] != UINT32_MAX && lastUsed[slot] + 1 < frame) {
+				candidates.push_back(slot);
+			}
+		}
+		size_t numEvictions = std::min(candidates.size(), requests.size() - freeSlots.size());
+		std::partial_sort(candidates.begin(), candidates.begin() + numEvictions, candidates.end(), [&](uint32_t a, uint32_t b) { return lastUsed[a] < lastUsed[b]; });
+		for (size_t i = 0; i < numEvictions; i++) {
+			uint32_t slot = candidates[i];
+			brickSlots[slotBricks[slot]] = 0;
+			slotBricks[slot] = UINT32_MAX;
+			freeSlots.push_back(slot);
+		}
+		requests.resize(std::min(requests.size(), freeSlots.size()));
+		if (requests.empty()) {
+			return;
+		}
+	}
+
+	uint32_t *stagingTexels = static_cast<uint32_t*>(staging.mapped);
+	util::parallelFor(uint32_t(requests.size()), numThreads, [&](uint32_t i) {
+		brickTree->gatherBrick(sourceNodes, requests[i], stagingTexels + size_t(i) * datastructure::BRICK_ATLAS_TEXELS);
+	});
+
+	std::vector<VkBufferImageCopy> copyRegions(requests.size());
+	for (size_t i = 0; i < requests.size(); i++) {
+		uint32_t slot = freeSlots.back();
+		freeSlots.pop_back();
+		slotBricks[slot] = requests[i];
+		for (vk::Buffer& frameFeedback : feedback) {
+			static_cast<uint32_t*>(frameFeedback.mapped)[1 + MAX_BRICK_REQUESTS + slot] = frame;
+		}
+		// read by the next dispatch, which is submitted after the copies
+		brickSlots[requests[i]] = slot + 1;
+		glm::uvec3 origin = glm::uvec3(slot % atlasBricks.x, slot / atlasBricks.x % atlasBricks.y, slot / (atlasBricks.x * atlasBricks.y)) * datastructure::BRICK_ATLAS_SIZE;
+
+		VkBufferImageCopy& copyRegion = copyRegions[i];
+		copyRegion = {};
+		copyRegion.bufferOffset = VkDeviceSize(i) * datastructure::BRICK_ATLAS_TEXELS * sizeof(uint32_t);
+		copyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		copyRegion.imageSubresource.mipLevel = 0;
+		copyRegion.imageSubresource.baseArrayLayer = 0;
+		copyRegion.imageSubresource.layerCount = 1;
+		copyRegion.imageOffset = { int32_t(origin.x), int32_t(origin.y), int32_t(origin.z) };
+		copyRegion.imageExtent = { datastructure::BRICK_ATLAS_SIZE, datastructure::BRICK_ATLAS_SIZE, datastructure::BRICK_ATLAS_SIZE };
+	}
+
+	// the previous copies have finished, the caller waited for the dispatch behind them
+	VkCommandBufferBeginInfo cmdBufInfo = vkTools::initializers::commandBufferBeginInfo();
+	VK_CHECK_RESULT(vkBeginCommandBuffer(commandBuffer, &cmdBufInfo));
+	VkImageMemoryBarrier barrier = vkTools::initializers::imageMemoryBarrier();
+	barrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.oldLayout = atlas.imageLayout;
+	barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = atlas.image;
+	barrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_FLAGS_NONE, 0, nullptr, 0, nullptr, 1, &barrier);
+	vkCmdCopyBufferToImage(commandBuffer, staging.buffer, atlas.image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, uint32_t(copyRegions.size()), copyRegions.data());
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barrier.newLayout = atlas.imageLayout;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_FLAGS_NONE, 0, nullptr, 0, nullptr, 1, &barrier);
+	VK_CHECK_RESULT(vkEndCommandBuffer(commandBuffer));
+
+	VkSubmitInfo submitInfo = vkTools::initializers::submitInfo();
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &commandBuffer;
+	VK_CHECK_RESULT(vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE));
+
+	loadedBricks = uint32_t(requests.size());
+}
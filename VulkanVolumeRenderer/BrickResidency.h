@@ -0,0 +1,81 @@
+#pragma once
+
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "vulkantools.h"
+#include "vulkandevice.hpp"
+#include "vulkanTextureLoader.hpp"
+
+#include "BrickTree.hpp"
+
+// brick requests the compute shader can report per frame, has to match MAX_BRICK_REQUESTS in raytracing.comp
+const uint32_t MAX_BRICK_REQUESTS = 1024;
+
+// keeps a fixed number of bricks resident in a 3D atlas and pages bricks in on demand: the compute shader looks up
+// the atlas slot of a brick in the slot table, stamps the slots it samples with the frame number and requests bricks
+// without a slot through the feedback buffer. Between frames the requested bricks are gathered from the source tree
+// into slots that are free or were least recently used; until a brick is resident its node is drawn with its color.
+// Every frame in flight has a feedback buffer of its own, so the requests of a finished frame are read without
+// waiting for the others.
+class BrickResidency {
+private:
+	vk::VulkanDevice *vulkanDevice;
+	// copies are submitted to the compute queue, so they are ordered before the next dispatch
+	VkQueue queue;
+	VkCommandPool commandPool;
+	VkCommandBuffer commandBuffer;
+	vk::Buffer staging;
+
+	const datastructure::BrickTree *brickTree;
+	const datastructure::Node *sourceNodes;
+	uint32_t maxLoadsPerFrame;
+	uint32_t numThreads;
+
+	uint32_t numSlots = 1;
+	glm::uvec3 atlasBricks = glm::uvec3(1);
+	// brick in every slot, UINT32_MAX if the slot is free
+	std::vector<uint32_t> slotBricks;
+	std::vector<uint32_t> freeSlots;
+	uint32_t loadedBricks = 0;
+
+	void prepareAtlas();
+
+public:
+	vkTools::VulkanTexture atlas;
+	// slot + 1 of every brick, 0 while it is not resident
+	vk::Buffer slotTable;
+	// per frame: request count, MAX_BRICK_REQUESTS requested bricks and the frame every slot was last sampled in
+	std::vector<vk::Buffer> feedback;
+
+	// the pool holds as many bricks as fit into poolSize bytes and the maximum 3D image extent, without a brick tree
+	// only a transparent texel and empty tables are created; brickTree and sourceNodes have to stay valid
+	BrickResidency(vk::VulkanDevice *vulkanDevice, const datastructure::BrickTree *brickTree, const datastructure::Node *sourceNodes, VkDeviceSize poolSize, uint32_t numFrames, uint32_t maxLoadsPerFrame = 256, uint32_t numThreads = 0);
+
+	~BrickResidency();
+
+	// whether the dispatch of frame slot frameIndex reported missing bricks, it has to be finished
+	bool hasRequests(uint32_t frameIndex) const;
+
+	// reads the requests of all frames and pages the bricks in, the compute queue must not execute a ray tracing
+	// dispatch while this runs; frame is the number of the next frame, the last one was frame - 1
+	void update(uint32_t frame);
+
+	glm::uvec3 getAtlasBricks() const {
+		return atlasBricks;
+	}
+
+	uint32_t getNumSlots() const {
+		return numSlots;
+	}
+
+	// bricks paged in by the last update
+	uint32_t getLoadedBricks() const {
+		return loadedBricks;
+	}
+
+	uint32_t getResidentBricks() const {
+		return numSlots - uint32_t(freeSlots.size());
+	}
+};
@@ -0,0 +1,140 @@
+#include "BrickTree.hpp"
+
+#include <chrono>
+#include <iostream>
+
+namespace datastructure {
+
+	namespace {
+		const uint32_t BRICK_VOXELS = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE;
+
+		uint64_t brickKey(glm::uvec3 pos) {
+			return uint64_t(pos.x) | uint64_t(pos.y) << 21 | uint64_t(pos.z) << 42;
+		}
+
+		// node color (r << 24 | g << 16 | b << 8 | a) to an RGBA8 texel with premultiplied alpha, so that filtering
+		// does not darken the border towards transparent voxels
+		uint32_t toTexel(uint32_t color) {
+			uint32_t alpha = color & 0xFF;
+			uint32_t texel = alpha << 24;
+			for (uint32_t channel = 0; channel < 3; channel++) {
+				uint32_t value = (color >> (24 - 8 * channel)) & 0xFF;
+				texel |= ((value * alpha + 127) / 255) << (8 * channel);
+			}
+			return texel;
+		}
+
+		// writes the voxels below a node into a brick, nodes without children cover their whole extent with their color
+		void gatherVoxels(const Node* nodes, uint32_t nodeIdx, glm::uvec3 origin, uint32_t size, uint32_t* brick) {
+			const Node& node = nodes[nodeIdx];
+			if (node.firstChild == 0 || size == 1) {
+				uint32_t texel = toTexel(node.color);
+				for (uint32_t z = origin.z; z < origin.z + size; z++) {
+					for (uint32_t y = origin.y; y < origin.y + size; y++) {
+						for (uint32_t x = origin.x; x < origin.x + size; x++) {
+							brick[(z * BRICK_SIZE + y) * BRICK_SIZE + x] = texel;
+						}
+					}
+				}
+				return;
+			}
+			size /= 2;
+			for (uint32_t i = 0; i < 8; i++) {
+				glm::uvec3 childOrigin = origin + glm::uvec3(i & 1, (i >> 1) & 1, (i >> 2) & 1) * size;
+				gatherVoxels(nodes, node.firstChild + i, childOrigin, size, brick);
+			}
+		}
+	}
+
+	bool BrickTree::build(const Node* sourceNodes, uint64_t numSourceNodes, uint32_t depth) {
+		auto tStart = std::chrono::high_resolution_clock::now();
+		if (depth <= BRICK_LEVELS) {
+			std::cout << "Octree of depth " << depth << " is too shallow for bricks of " << BRICK_SIZE << " voxels" << std::endl;
+			return false;
+		}
+		brickLevel = depth - BRICK_LEVELS;
+
+		// walks the levels down to the brick level, keeping the position of every node in units of its level
+		std::vector<glm::uvec3> levelPositions = { glm::uvec3(0) };
+		uint64_t levelStart = 0;
+		uint64_t parentLevelStart = 0;
+		for (uint32_t level = 0; level < brickLevel; level++) {
+			std::vector<glm::uvec3> childPositions;
+			for (uint64_t i = 0; i < levelPositions.size(); i++) {
+				if (sourceNodes[levelStart + i].firstChild != 0) {
+					for (uint32_t child = 0; child < 8; child++) {
+						childPositions.push_back(levelPositions[i] * 2u + glm::uvec3(child & 1, (child >> 1) & 1, (child >> 2) & 1));
+					}
+				}
+			}
+			parentLevelStart = levelStart;
+			levelStart += levelPositions.size();
+			levelPositions.swap(childPositions);
+		}
+		uint64_t brickLevelEnd = levelStart + levelPositions.size();
+		if (brickLevelEnd > numSourceNodes) {
+			std::cout << "Octree is incomplete, cannot build bricks" << std::endl;
+			return false;
+		}
+
+		nodes.assign(sourceNodes, sourceNodes + brickLevelEnd);
+		sources.clear();
+		positions.clear();
+		indices.clear();
+		for (uint64_t i = 0; i < levelPositions.size(); i++) {
+			Node& node = nodes[size_t(levelStart + i)];
+			node.childMasks = 0;
+			if (node.firstChild != 0) {
+				indices[brickKey(levelPositions[i])] = uint32_t(sources.size());
+				sources.push_back(node.firstChild);
+				positions.push_back(levelPositions[i]);
+				node.firstChild = uint32_t(sources.size());
+			}
+		}
+		// the nodes on the brick level have no children anymore
+		for (uint64_t i = parentLevelStart; i < levelStart; i++) {
+			if (nodes[size_t(i)].firstChild != 0) {
+				nodes[size_t(i)].childMasks |= 0xFFu << LEAF_CHILDREN_SHIFT;
+			}
+		}
+
+		auto tEnd = std::chrono::high_resolution_clock::now();
+		std::cout << "Brick tree: " << nodes.size() << " of " << numSourceNodes << " nodes, " << numBricks() << " bricks of " << BRICK_SIZE << "^3 voxels ("
+			<< uint64_t(numBricks()) * BRICK_ATLAS_TEXELS * sizeof(uint32_t) / 1000000.0f << " MB), "
+			<< std::chrono::duration<double, std::milli>(tEnd - tStart).count() << " ms" << std::endl;
+		return true;
+	}
+
+	void BrickTree::gatherBrick(const Node* sourceNodes, uint32_t brick, uint32_t* texels) const {
+		uint32_t voxels[BRICK_VOXELS];
+		// the brick itself and its 26 neighbours, each one fills the texels on its side
+		for (uint32_t n = 0; n < 27; n++) {
+			glm::ivec3 side(n % 3, n / 3 % 3, n / 9);
+			glm::ivec3 pos = glm::ivec3(positions[brick]) + side - 1;
+			auto found = glm::any(glm::lessThan(pos, glm::ivec3(0))) ? indices.end() : indices.find(brickKey(glm::uvec3(pos)));
+			bool transparent = found == indices.end();
+			if (!transparent) {
+				for (uint32_t i = 0; i < 8; i++) {
+					glm::uvec3 origin = glm::uvec3(i & 1, (i >> 1) & 1, (i >> 2) & 1) * (BRICK_SIZE / 2);
+					gatherVoxels(sourceNodes, sources[found->second] + i, origin, BRICK_SIZE / 2, voxels);
+				}
+			}
+			// side 0 is the last voxel layer of the neighbour in texel 0, side 2 the first one in texel BRICK_SIZE + 1
+			glm::uvec3 begin = glm::uvec3(side.x == 0 ? 0 : side.x == 1 ? 1 : BRICK_SIZE + 1, side.y == 0 ? 0 : side.y == 1 ? 1 : BRICK_SIZE + 1, side.z == 0 ? 0 : side.z == 1 ? 1 : BRICK_SIZE + 1);
+			glm::uvec3 end = glm::uvec3(side.x == 1 ? BRICK_SIZE + 1 : begin.x + 1, side.y == 1 ? BRICK_SIZE + 1 : begin.y + 1, side.z == 1 ? BRICK_SIZE + 1 : begin.z + 1);
+			for (uint32_t z = begin.z; z < end.z; z++) {
+				for (uint32_t y = begin.y; y < end.y; y++) {
+					for (uint32_t x = begin.x; x < end.x; x++) {
+						uint32_t& texel = texels[(z * BRICK_ATLAS_SIZE + y) * BRICK_ATLAS_SIZE + x];
+						if (transparent) {
+							texel = 0;
+							continue;
+						}
+						glm::uvec3 local = (glm::uvec3(x, y, z) + (BRICK_SIZE - 1)) % BRICK_SIZE;
+						texel = voxels[(local.z * BRICK_SIZE + local.y) * BRICK_SIZE + local.x];
+					}
+				}
+			}
+		}
+	}
+}
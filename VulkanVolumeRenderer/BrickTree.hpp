@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "Octree.hpp"
+
+namespace datastructure {
+	// voxels per brick side, a brick replaces the lowest BRICK_LEVELS levels below a node
+	const uint32_t BRICK_SIZE = 8;
+	const uint32_t BRICK_LEVELS = 3;
+
+	// texels per brick side in the atlas: every brick repeats the border voxels of its neighbours,
+	// so trilinear filtering inside a brick never reads texels of another brick
+	const uint32_t BRICK_ATLAS_SIZE = BRICK_SIZE + 2;
+	const uint32_t BRICK_ATLAS_TEXELS = BRICK_ATLAS_SIZE * BRICK_ATLAS_SIZE * BRICK_ATLAS_SIZE;
+
+	// a tree that ends BRICK_LEVELS above the voxels, the voxels below the last level are stored in bricks
+	// that are gathered from the source tree when they are needed
+	class BrickTree {
+	private:
+		// first child of the brick nodes in the source tree
+		std::vector<uint32_t> sources;
+		// position of every brick in bricks
+		std::vector<glm::uvec3> positions;
+		std::unordered_map<uint64_t, uint32_t> indices;
+
+	public:
+		// levels 0 to brickLevel of the tree, firstChild of the nodes on brickLevel is the brick index + 1 (0: no brick)
+		// and their parents mark them as leaves
+		std::vector<Node> nodes;
+		uint32_t brickLevel = 0;
+
+		// replaces the lowest levels of a finished tree with bricks, returns false if the tree is too shallow
+		bool build(const Node* sourceNodes, uint64_t numSourceNodes, uint32_t depth);
+
+		uint32_t numBricks() const {
+			return uint32_t(sources.size());
+		}
+
+		// writes the BRICK_ATLAS_TEXELS RGBA8 texels of a brick (x fastest, premultiplied alpha) including the
+		// border voxels of its neighbours, sourceNodes is the tree passed to build()
+		void gatherBrick(const Node* sourceNodes, uint32_t brick, uint32_t* texels) const;
+	};
+}
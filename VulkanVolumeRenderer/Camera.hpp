@@ -20,6 +20,7 @@ private:
 		transM = glm::translate(glm::mat4(), position);
 
 		matrices.view = transM*rotM;
+		updated = true;
 	};
 public:
 	glm::vec3 rotation = glm::vec3();
@@ -28,6 +29,9 @@ public:
 	float rotationSpeed = 1.0f;
 	float movementSpeed = 1.0f;
 
+	// set whenever the view matrix changes, reset by whoever consumes it
+	bool updated = false;
+
 	struct {
 		glm::mat4 perspective;
 		glm::mat4 view;
@@ -1,55 +1,212 @@
 #include "ComputePipeline.h"
 
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <string>
+
 // private
 
 void ComputePipeline::prepareStorageBuffers(std::string path) {
-	std::vector<uint32_t> voxelData;
-	datastructure::loadVoxelDataFromTxt(path, &voxelData);
-	datastructure::Octree* octree = new datastructure::Octree(&voxelData, glm::vec3(0.0f, 0.000001f, 0.0f), 0.001);
-	octree->removeEmptyNodes();
-	res.ubo.octreeData.pos = octree->pos;
-	res.ubo.octreeData.voxelFreq = octree->voxelFreq;
-	res.ubo.octreeData.numVoxelsSide = octree->numVoxelsSide;
-
-	VkDeviceSize storageBufferSize = octree->numNodes() * sizeof(datastructure::Node);
+	// every node segment is a binding of its own next to the brick feedback and the slot table, a device with fewer
+	// storage buffers gets fewer segments
+	const VkPhysicalDeviceLimits& limits = vulkanDevice->properties.limits;
+	uint32_t maxStorageBuffers = std::min(limits.maxPerStageDescriptorStorageBuffers, limits.maxDescriptorSetStorageBuffers);
+	if (maxStorageBuffers < 3) {
+		vkTools::exitFatal("The ray tracing shader needs 3 storage buffers, the device supports " + std::to_string(maxStorageBuffers), "Fatal error");
+	}
+	VkDeviceSize maxSegmentSize = nodeSegmentSize == 0 ? limits.maxStorageBufferRange : std::min<VkDeviceSize>(nodeSegmentSize, limits.maxStorageBufferRange);
+	uint32_t maxSegments = std::min(MAX_NODE_SEGMENTS, maxStorageBuffers - 2);
+	std::cout << "Node storage: up to " << maxSegments << " buffers of " << maxSegmentSize / 1000000.0 << " MB (maxStorageBufferRange "
+		<< limits.maxStorageBufferRange / 1000000.0 << " MB)" << std::endl;
+	uploader = new StorageBufferUploader(vulkanDevice, &res.storageBuffers.voxels, maxSegmentSize, maxSegments);
+
+	// a cached tree built from the same source is uploaded straight from its file mapping
+	datastructure::OctreeCacheKey cacheKey;
+	std::string cachePath = path + datastructure::OCTREE_CACHE_EXTENSION;
+	bool cacheKeyValid = useOctreeCache && datastructure::makeOctreeCacheKey(path, OCTREE_POSITION, OCTREE_VOXEL_FREQ, &cacheKey);
+	if (cacheKeyValid) {
+		octreeCache = new datastructure::OctreeCache();
+		if (octreeCache->open(cachePath, cacheKey)) {
+			setOctreeData(*octreeCache);
+			if (uploadNodes(octreeCache->nodes(), octreeCache->numNodes())) {
+				delete octreeCache;
+				octreeCache = nullptr;
+			}
+			return;
+		}
+		delete octreeCache;
+		octreeCache = nullptr;
+	}
+
+	datastructure::Volume volume;
+	if (!volume.load(path)) {
+		vkTools::exitFatal("Could not load volume data set " + path, "Fatal error");
+	}
+	// the uploader receives the levels while the tree is assembled, so the upload overlaps the build;
+	// bricks, the DAG, the compact encoding and trees beyond one storage buffer need the finished tree
+	bool convertNodes = useBricks || useOctreeDag || compactNodeEncoding;
+	octree = new datastructure::Octree(volume.view(), OCTREE_POSITION, OCTREE_VOXEL_FREQ, octreeBuildThreads, convertNodes ? nullptr : uploader);
+	if (!octree->isValid()) {
+		vkTools::exitFatal("Could not build the octree of " + path, "Fatal error");
+	}
+	setOctreeData(*octree);
+
+	if (cacheKeyValid) {
+		datastructure::writeOctreeCache(cachePath, cacheKey, *octree);
+	}
+	if (!convertNodes && uploader->started()) {
+		std::cout << "Octree size: " << octree->numNodes() * sizeof(datastructure::Node) / 1000000000.0f << " GB" << std::endl;
+		waitForTopLevels();
+		return;
+	}
+	if (uploadNodes(static_cast<const datastructure::Node*>(octree->data()), octree->numNodes())) {
+		delete octree;
+		octree = nullptr;
+	}
+}
+
+bool ComputePipeline::uploadNodes(const datastructure::Node* nodes, uint64_t numNodes) {
+	if (useBricks) {
+		brickTree = new datastructure::BrickTree();
+		if (brickTree->build(nodes, numNodes, uint32_t(res.ubo.octreeData.depth))) {
+			// brick pointers are neither merged nor encoded
+			if (useOctreeDag || compactNodeEncoding) {
+				std::cout << "Bricks are used without the DAG and the compact encoding" << std::endl;
+			}
+			res.ubo.octreeData.brickLevel = brickTree->brickLevel;
+			// the bricks are gathered from the source tree while rendering, so it is kept
+			brickSourceNodes = nodes;
+			nodes = brickTree->nodes.data();
+			numNodes = brickTree->nodes.size();
+		} else {
+			std::cout << "Falling back to voxel leaves" << std::endl;
+			delete brickTree;
+			brickTree = nullptr;
+		}
+	}
+	if (brickTree == nullptr && useOctreeDag) {
+		dagNodes = new std::vector<datastructure::Node>(datastructure::buildOctreeDag(nodes, numNodes, dagColorTolerance));
+		nodes = dagNodes->data();
+		numNodes = dagNodes->size();
+	}
+	if (brickTree == nullptr && compactNodeEncoding && uploadCompactNodes(nodes, numNodes)) {
+		return true;
+	}
+	VkDeviceSize storageBufferSize = numNodes * sizeof(datastructure::Node);
 	std::cout << "Octree size: " << storageBufferSize / 1000000000.0f << " GB" << std::endl;
+	if (storageBufferSize <= uploader->getMaxSegmentSize()) {
+		uploader->begin({ storageBufferSize });
+		uploader->setAvailable(0, nodes, storageBufferSize);
+		waitForTopLevels();
+		return dagNodes != nullptr;
+	}
+
+	// a larger tree is split into subtrees that are uploaded one segment after another from a copy, which
+	// replaces the passed tree unless bricks are gathered from it
+	uint32_t pointerLevels = brickTree != nullptr ? brickTree->brickLevel : uint32_t(res.ubo.octreeData.depth);
+	nodeSegments = new datastructure::NodeSegments();
+	if (!datastructure::splitNodeSegments(nodes, numNodes, pointerLevels, uploader->getMaxSegmentSize() / sizeof(datastructure::Node), uploader->getMaxSegments(), nodeSegments)) {
+		vkTools::exitFatal("The octree of " + std::to_string(storageBufferSize / 1000000) + " MB exceeds " + std::to_string(uploader->getMaxSegments())
+			+ " storage buffers of " + std::to_string(uploader->getMaxSegmentSize() / 1000000) + " MB", "Fatal error");
+	}
+	std::vector<VkDeviceSize> segmentSizes;
+	for (const std::vector<datastructure::Node>& segment : nodeSegments->segments) {
+		segmentSizes.push_back(segment.size() * sizeof(datastructure::Node));
+	}
+	uploader->begin(segmentSizes);
+	for (uint32_t i = 0; i < segmentSizes.size(); i++) {
+		uploader->setAvailable(i, nodeSegments->segments[i].data(), segmentSizes[i]);
+	}
+	waitForTopLevels();
+	return brickTree == nullptr;
+}
+
+bool ComputePipeline::uploadCompactNodes(const datastructure::Node* nodes, uint64_t numNodes) {
+	compactNodes = new std::vector<datastructure::CompactNodes>(1);
+	bool encoded = false;
+	bool fits = false;
+	if (numNodes <= uint64_t(datastructure::NODE_INDEX_MASK) + 1) {
+		encoded = datastructure::encodeCompactNodes(nodes, numNodes, &(*compactNodes)[0]);
+		fits = (*compactNodes)[0].words.size() * sizeof(uint32_t) <= uploader->getMaxSegmentSize();
+	}
+	if (!fits && (encoded || numNodes > uint64_t(datastructure::NODE_INDEX_MASK) + 1)) {
+		// every segment is encoded on its own, the split assumes a far pointer per node, i.e. 9 bytes per node
+		// with the intensities rounded up to a word
+		datastructure::NodeSegments segments;
+		encoded = datastructure::splitNodeSegments(nodes, numNodes, uint32_t(res.ubo.octreeData.depth), (uploader->getMaxSegmentSize() - 3) / 9,
+			uploader->getMaxSegments(), &segments);
+		compactNodes->assign(segments.segments.size(), datastructure::CompactNodes());
+		for (uint32_t i = 0; i < segments.segments.size() && encoded; i++) {
+			encoded = datastructure::encodeCompactNodes(segments.segments[i].data(), segments.segments[i].size(), &(*compactNodes)[i], i);
+		}
+	}
+	if (!encoded) {
+		std::cout << "Falling back to the standard node encoding" << std::endl;
+		delete compactNodes;
+		compactNodes = nullptr;
+		return false;
+	}
+	res.ubo.octreeData.encoding = datastructure::NODE_ENCODING_COMPACT;
+	std::vector<VkDeviceSize> segmentSizes;
+	for (uint32_t i = 0; i < compactNodes->size(); i++) {
+		res.ubo.octreeData.farPointerOffsets[i / 4][i % 4] = (*compactNodes)[i].farPointerOffset;
+		res.ubo.octreeData.attributeOffsets[i / 4][i % 4] = (*compactNodes)[i].attributeOffset;
+		segmentSizes.push_back((*compactNodes)[i].words.size() * sizeof(uint32_t));
+	}
+
+	// the intensities are stored behind all node words, so nothing can be drawn before the whole tree is resident
+	uploader->begin(segmentSizes);
+	for (uint32_t i = 0; i < segmentSizes.size(); i++) {
+		uploader->setAvailable(i, (*compactNodes)[i].words.data(), segmentSizes[i]);
+	}
+	uploader->waitResident(UINT64_MAX);
+	res.ubo.octreeData.residentSegments = uploader->residentSegments();
+	res.ubo.octreeData.residentNodes = 0;
+	return true;
+}
+
+void ComputePipeline::waitForTopLevels() {
+	// the first chunk holds the root and the levels below it, a tree that is still assembled has flushed just its
+	// top levels in it; the rest is streamed while rendering
+	uploader->waitResident(1);
+	updateResidentNodes();
+}
+
+bool ComputePipeline::updateResidentNodes() {
+	uint32_t residentSegments = uploader->residentSegments();
+	uint32_t residentNodes = uint32_t(uploader->residentInSegment() / sizeof(datastructure::Node));
+	bool changed = residentSegments != res.ubo.octreeData.residentSegments || residentNodes != res.ubo.octreeData.residentNodes;
+	res.ubo.octreeData.residentSegments = residentSegments;
+	res.ubo.octreeData.residentNodes = residentNodes;
+	return changed;
+}
 
-	initStorageBuffer(octree->data(), &res.storageBuffers.voxels, storageBufferSize);
+void ComputePipeline::setOctreeData(const datastructure::OctreeLayout& layout) {
+	res.ubo.octreeData.pos = layout.pos;
+	res.ubo.octreeData.voxelFreq = layout.voxelFreq;
+	res.ubo.octreeData.numVoxelsSide = layout.numVoxelsSide;
+	res.ubo.octreeData.voxelSize = layout.voxelSize;
+	res.ubo.octreeData.dims = glm::ivec3(layout.dims);
+	res.ubo.octreeData.depth = int32_t(layout.depth);
 }
 
-void ComputePipeline::initStorageBuffer(void* data, vk::Buffer* buffer, VkDeviceSize storageBufferSize) {
-	vk::Buffer stagingBuffer;
-	vulkanDevice->createBuffer(
-		VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		&stagingBuffer,
-		storageBufferSize,
-		data);
-
-	vulkanDevice->createBuffer(
-		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-		buffer,
-		storageBufferSize);
-
-	// copy to staging buffer
-	VkCommandBuffer copyCmd = util::createCommandBuffer(vulkanDevice->logicalDevice, vulkanDevice->commandPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
-	VkBufferCopy copyRegion = {};
-	copyRegion.size = storageBufferSize;
-	vkCmdCopyBuffer(copyCmd, stagingBuffer.buffer, buffer->buffer, 1, &copyRegion);
-	util::flushCommandBuffer(vulkanDevice->logicalDevice, vulkanDevice->commandPool, copyCmd, *queue, true);
-
-	stagingBuffer.destroy();
+void ComputePipeline::prepareBrickResidency() {
+	brickResidency = new BrickResidency(vulkanDevice, brickTree, brickSourceNodes, brickPoolSize, uint32_t(res.frames.size()), brickLoadsPerFrame, octreeBuildThreads);
+	res.ubo.octreeData.brickAtlasWidth = brickResidency->getAtlasBricks().x;
+	res.ubo.octreeData.brickAtlasHeight = brickResidency->getAtlasBricks().y;
 }
 
 void ComputePipeline::prepareUniformBuffers() {
-	vulkanDevice->createBuffer(
-		VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-		&res.uniformBuffer,
-		sizeof(res.ubo));
+	// every frame reads its own slice, so the next frame can be written while the last ones are still executed
+	res.uniformRing = new UniformRing(vulkanDevice, sizeof(res.ubo), uint32_t(res.frames.size()));
 
 	updateUniformBuffers(glm::mat4(0), glm::vec3(0));
+	for (uint32_t i = 0; i < res.frames.size(); i++) {
+		writeUniformBuffer(i);
+	}
 }
 
 void ComputePipeline::prepareTextureTarget(vkTools::VulkanTexture *tex, uint32_t width, uint32_t height, VkFormat format) {
@@ -74,16 +231,19 @@ void ComputePipeline::prepareTextureTarget(vkTools::VulkanTexture *tex, uint32_t
 	// the fragment shader samples the image and the compute shader uses it as storage target
 	imageCreateInfo.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT;
 	imageCreateInfo.flags = 0;
-
-	VkMemoryAllocateInfo memAllocInfo = vkTools::initializers::memoryAllocateInfo();
-	VkMemoryRequirements memReqs;
+	// the compute queue writes the image while the graphics queue transitions and samples it; concurrent sharing
+	// saves releasing and acquiring the image between the queue families every frame, also for frames that only
+	// present the last dispatch again
+	std::array<uint32_t, 2> queueFamilies = { vulkanDevice->queueFamilyIndices.graphics, vulkanDevice->queueFamilyIndices.compute };
+	if (queueFamilies[0] != queueFamilies[1]) {
+		imageCreateInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+		imageCreateInfo.queueFamilyIndexCount = uint32_t(queueFamilies.size());
+		imageCreateInfo.pQueueFamilyIndices = queueFamilies.data();
+	}
 
 	VK_CHECK_RESULT(vkCreateImage(vulkanDevice->logicalDevice, &imageCreateInfo, nullptr, &tex->image));
-	vkGetImageMemoryRequirements(vulkanDevice->logicalDevice, tex->image, &memReqs);
-	memAllocInfo.allocationSize = memReqs.size;
-	memAllocInfo.memoryTypeIndex = vulkanDevice->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-	VK_CHECK_RESULT(vkAllocateMemory(vulkanDevice->logicalDevice, &memAllocInfo, nullptr, &tex->deviceMemory));
-	VK_CHECK_RESULT(vkBindImageMemory(vulkanDevice->logicalDevice, tex->image, tex->deviceMemory, 0));
+	VK_CHECK_RESULT(vulkanDevice->allocateImageMemory(tex->image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &tex->allocation));
+	tex->deviceMemory = tex->allocation.memory;
 
 	VkCommandBuffer layoutCmd = util::createCommandBuffer(vulkanDevice->logicalDevice, vulkanDevice->commandPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
 
@@ -126,17 +286,65 @@ void ComputePipeline::prepareTextureTarget(vkTools::VulkanTexture *tex, uint32_t
 	tex->descriptor.sampler = tex->sampler;
 }
 
-void ComputePipeline::buildComputeCommandBuffer(vkTools::VulkanTexture *textureComputeTarget) {
-	VkCommandBufferBeginInfo cmdBufInfo = vkTools::initializers::commandBufferBeginInfo();
+void ComputePipeline::createPipeline() {
+	std::vector<VkSpecializationMapEntry> specializationMapEntries = {
+		{ 0, offsetof(ShaderConstants, workgroupSizeX), sizeof(uint32_t) },
+		{ 1, offsetof(ShaderConstants, workgroupSizeY), sizeof(uint32_t) },
+		{ 2, offsetof(ShaderConstants, maxLayers), sizeof(uint32_t) },
+		{ 3, offsetof(ShaderConstants, maxLength), sizeof(float) },
+		{ 4, offsetof(ShaderConstants, brickStep), sizeof(float) },
+		{ 5, offsetof(ShaderConstants, nodeSegments), sizeof(uint32_t) }
+	};
+	VkSpecializationInfo specializationInfo = {};
+	specializationInfo.mapEntryCount = uint32_t(specializationMapEntries.size());
+	specializationInfo.pMapEntries = specializationMapEntries.data();
+	specializationInfo.dataSize = sizeof(shaderConstants);
+	specializationInfo.pData = &shaderConstants;
+
+	VkComputePipelineCreateInfo computePipelineCreateInfo =
+		vkTools::initializers::computePipelineCreateInfo(
+			res.pipelineLayout,
+			0);
+	computePipelineCreateInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	computePipelineCreateInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	computePipelineCreateInfo.stage.module = shaderModule;
+	computePipelineCreateInfo.stage.pName = "main";
+	computePipelineCreateInfo.stage.pSpecializationInfo = &specializationInfo;
+	VK_CHECK_RESULT(vkCreateComputePipelines(vulkanDevice->logicalDevice, pipelineCache, 1, &computePipelineCreateInfo, nullptr, &this->res.pipeline));
+}
 
-	VK_CHECK_RESULT(vkBeginCommandBuffer(this->res.commandBuffer, &cmdBufInfo));
+void ComputePipeline::buildComputeCommandBuffers(std::vector<vkTools::VulkanTexture> *textureComputeTargets) {
+	VkCommandBufferBeginInfo cmdBufInfo = vkTools::initializers::commandBufferBeginInfo();
 
-	vkCmdBindPipeline(this->res.commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, this->res.pipeline);
-	vkCmdBindDescriptorSets(this->res.commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, this->res.pipelineLayout, 0, 1, &this->res.descriptorSet, 0, 0);
+	for (uint32_t i = 0; i < res.frames.size(); i++) {
+		VkCommandBuffer commandBuffer = res.frames[i].commandBuffer;
+		VK_CHECK_RESULT(vkBeginCommandBuffer(commandBuffer, &cmdBufInfo));
+
+		// the accumulation image is shared by all frames, the last dispatch may still be writing the sum
+		VkMemoryBarrier accumulationBarrier = vkTools::initializers::memoryBarrier();
+		accumulationBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		accumulationBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_FLAGS_NONE, 1, &accumulationBarrier, 0, nullptr, 0, nullptr);
+
+		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, this->res.pipeline);
+		// the dynamic offset selects the uniform slice of the frame
+		uint32_t uniformOffset = res.uniformRing->getDynamicOffset(i);
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, this->res.pipelineLayout, 0, 1, &res.frames[i].descriptorSet, 1, &uniformOffset);
+
+		// partial tiles at the border are dispatched as well, the shader skips invocations outside the image
+		vkCmdDispatch(commandBuffer,
+			((*textureComputeTargets)[i].width + shaderConstants.workgroupSizeX - 1) / shaderConstants.workgroupSizeX,
+			((*textureComputeTargets)[i].height + shaderConstants.workgroupSizeY - 1) / shaderConstants.workgroupSizeY,
+			1);
 
-	vkCmdDispatch(this->res.commandBuffer, textureComputeTarget->width / 16, textureComputeTarget->height / 16, 1);
+		// the brick requests are read on the host once the fence signals
+		VkMemoryBarrier feedbackBarrier = vkTools::initializers::memoryBarrier();
+		feedbackBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		feedbackBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, VK_FLAGS_NONE, 1, &feedbackBarrier, 0, nullptr, 0, nullptr);
 
-	vkEndCommandBuffer(this->res.commandBuffer);
+		vkEndCommandBuffer(commandBuffer);
+	}
 }
 
 // public
@@ -150,33 +358,226 @@ ComputePipeline::~ComputePipeline() {
 	vkDestroyPipeline(vulkanDevice->logicalDevice, this->res.pipeline, nullptr);
 	vkDestroyPipelineLayout(vulkanDevice->logicalDevice, this->res.pipelineLayout, nullptr);
 	vkDestroyDescriptorSetLayout(vulkanDevice->logicalDevice, this->res.descriptorSetLayout, nullptr);
-	vkDestroyFence(vulkanDevice->logicalDevice, this->res.fence, nullptr);
+	for (Resources::Frame& frame : res.frames) {
+		vkDestroyFence(vulkanDevice->logicalDevice, frame.fence, nullptr);
+		vkDestroySemaphore(vulkanDevice->logicalDevice, frame.complete, nullptr);
+	}
 	vkDestroyCommandPool(vulkanDevice->logicalDevice, this->res.commandPool, nullptr);
-	this->res.uniformBuffer.destroy();
-	this->res.storageBuffers.voxels.destroy();
+	delete uploader;
+	delete octree;
+	delete octreeCache;
+	delete compactNodes;
+	delete dagNodes;
+	delete nodeSegments;
+	delete brickResidency;
+	delete brickTree;
+	delete res.uniformRing;
+	vkDestroyImageView(vulkanDevice->logicalDevice, res.accumulation.view, nullptr);
+	vkDestroyImage(vulkanDevice->logicalDevice, res.accumulation.image, nullptr);
+	vkDestroySampler(vulkanDevice->logicalDevice, res.accumulation.sampler, nullptr);
+	vulkanDevice->allocator->free(res.accumulation.allocation);
+	for (vk::Buffer& segment : this->res.storageBuffers.voxels) {
+		segment.destroy();
+	}
 }
 
-void ComputePipeline::prepare(std::string path, vkTools::VulkanTexture *tex, uint32_t width, uint32_t height) {
+void ComputePipeline::prepare(std::string path, std::vector<vkTools::VulkanTexture> *textureComputeTargets, uint32_t width, uint32_t height) {
+	res.frames.resize(textureComputeTargets->size());
 	prepareStorageBuffers(path);
+	prepareBrickResidency();
 	prepareUniformBuffers();
-	prepareTextureTarget(tex, width, height, VK_FORMAT_R8G8B8A8_SNORM);
+	for (vkTools::VulkanTexture& target : *textureComputeTargets) {
+		prepareTextureTarget(&target, width, height, VK_FORMAT_R8G8B8A8_SNORM);
+	}
+	prepareTextureTarget(&res.accumulation, width, height, VK_FORMAT_R32G32B32A32_SFLOAT);
+}
+
+void ComputePipeline::updateStorageBufferUpload() {
+	if (uploader == nullptr) {
+		return;
+	}
+	uploader->update();
+	if (res.ubo.octreeData.encoding == datastructure::NODE_ENCODING_STANDARD && updateResidentNodes()) {
+		restartAccumulation();
+	}
+	if (uploader->finished()) {
+		// the staging ring and the host copy of the tree are only needed while uploading, unless bricks are gathered from it
+		delete uploader;
+		uploader = nullptr;
+		if (brickTree == nullptr) {
+			delete octree;
+			octree = nullptr;
+			delete octreeCache;
+			octreeCache = nullptr;
+		} else {
+			std::vector<datastructure::Node>().swap(brickTree->nodes);
+		}
+		delete compactNodes;
+		compactNodes = nullptr;
+		delete dagNodes;
+		dagNodes = nullptr;
+		delete nodeSegments;
+		nodeSegments = nullptr;
+		std::cout << "Octree upload finished" << std::endl;
+	}
+}
+
+void ComputePipeline::updateBrickResidency() {
+	if (brickTree == nullptr) {
+		return;
+	}
+	// the frame that is dispatched next has finished and reported the bricks it missed in its own feedback buffer;
+	// prepareFrame() waits for it anyway
+	VkFence finished = res.frames[frameIndex].fence;
+	VK_CHECK_RESULT(vkWaitForFences(vulkanDevice->logicalDevice, 1, &finished, VK_TRUE, UINT64_MAX));
+	res.ubo.octreeData.frame++;
+	if (!brickResidency->hasRequests(frameIndex)) {
+		return;
+	}
+	// the atlas and the slot table are shared by all frames, so bricks cannot be paged in while one of them is still
+	// executed
+	std::vector<VkFence> fences;
+	for (Resources::Frame& frame : res.frames) {
+		fences.push_back(frame.fence);
+	}
+	VK_CHECK_RESULT(vkWaitForFences(vulkanDevice->logicalDevice, uint32_t(fences.size()), fences.data(), VK_TRUE, UINT64_MAX));
+	brickResidency->update(res.ubo.octreeData.frame);
+	if (brickResidency->getLoadedBricks() > 0) {
+		restartAccumulation();
+	}
 }
 
 void ComputePipeline::updateUniformBuffers(glm::mat4 viewMat, glm::vec3 pos) {
 	res.ubo.viewMat = viewMat;
 	res.ubo.camera.pos = pos;
-	VK_CHECK_RESULT(this->res.uniformBuffer.map());
-	memcpy(res.uniformBuffer.mapped, &res.ubo, sizeof(res.ubo));
-	res.uniformBuffer.unmap();
+	if (viewMat != sampledViewMat || pos != sampledPos || res.ubo.aspectRatio != sampledAspectRatio) {
+		sampledViewMat = viewMat;
+		sampledPos = pos;
+		sampledAspectRatio = res.ubo.aspectRatio;
+		viewMoved = true;
+	}
+}
+
+void ComputePipeline::toggleTraversal() {
+	res.ubo.octreeData.traversal = res.ubo.octreeData.traversal == TRAVERSAL_PARAMETRIC ? TRAVERSAL_RESTART : TRAVERSAL_PARAMETRIC;
+	std::cout << "Octree traversal: " << (res.ubo.octreeData.traversal == TRAVERSAL_PARAMETRIC ? "parametric" : "restart") << std::endl;
+	restartAccumulation();
+}
+
+void ComputePipeline::setPixelError(float pixelError) {
+	this->pixelError = glm::clamp(pixelError, MIN_PIXEL_ERROR, MAX_PIXEL_ERROR);
+	interactivePixelError = glm::clamp(this->pixelError * (progressive ? INTERACTIVE_PIXEL_ERROR_SCALE : 1.0f), MIN_PIXEL_ERROR, MAX_PIXEL_ERROR);
+	restartAccumulation();
+}
+
+void ComputePipeline::toggleAutoLod() {
+	autoLod = !autoLod;
+	lodFrameTime = targetFrameTime;
+	if (autoLod) {
+		std::cout << "Level of detail: adjusted to " << targetFrameTime << " ms per frame" << std::endl;
+	} else {
+		std::cout << "Level of detail: fixed at " << pixelError << " pixels" << std::endl;
+		setPixelError(pixelError);
+	}
+}
+
+void ComputePipeline::toggleProgressive() {
+	progressive = !progressive;
+	std::cout << "Progressive refinement: " << (progressive ? "on" : "off") << std::endl;
+	setPixelError(pixelError);
+}
+
+void ComputePipeline::restartAccumulation() {
+	sampleCount = 0;
+}
+
+void ComputePipeline::updateLod(double frameTime) {
+	// still frames are refined at the fixed budget and stop once converged, only interactive frames are timed
+	if (!autoLod || !interactiveFrame) {
+		return;
+	}
+	// smoothed, so that single slow frames (e.g. while bricks are paged in) do not make the budget jump
+	lodFrameTime = lodFrameTime * 0.9 + frameTime * 0.1;
+	double ratio = lodFrameTime / targetFrameTime;
+	if (ratio > 0.95 && ratio < 1.05) {
+		return;
+	}
+	// small steps, the smoothed time lags behind the budget
+	double step = glm::clamp(std::sqrt(ratio), 0.9, 1.1);
+	interactivePixelError = glm::clamp(float(interactivePixelError * step), MIN_PIXEL_ERROR, MAX_PIXEL_ERROR);
+}
+
+bool ComputePipeline::prepareFrame() {
+	// the uniform slice and the command buffer of the frame are still in use until its last dispatch has finished, the
+	// accumulation image is ordered by a barrier in the command buffer
+	VK_CHECK_RESULT(vkWaitForFences(vulkanDevice->logicalDevice, 1, &this->res.frames[frameIndex].fence, VK_TRUE, UINT64_MAX));
+	if (profiler != nullptr) {
+		profiler->collect(profilerPass, frameIndex);
+	}
+	if (viewMoved) {
+		viewMoved = false;
+		sampleCount = 0;
+		interactiveFrame = true;
+	} else if (!progressive) {
+		// a single interactive frame per view, until the tree or the settings change
+		interactiveFrame = true;
+		if (sampleCount > 0) {
+			return false;
+		}
+	} else if (interactiveFrame) {
+		// the first still frame starts over at the finer budget
+		sampleCount = 0;
+		interactiveFrame = false;
+	} else if (sampleCount >= maxSamples) {
+		return false;
+	}
+
+	res.ubo.octreeData.pixelError = interactiveFrame ? interactivePixelError : pixelError;
+	res.ubo.octreeData.sampleIndex = sampleCount;
+	// the first sample is taken at the pixel corner like a single frame, later ones are spread over the pixel
+	res.ubo.octreeData.jitter = sampleCount == 0 ? glm::vec2(0.0f) : glm::vec2(util::halton(sampleCount, 2), util::halton(sampleCount, 3));
+	writeUniformBuffer(frameIndex);
+	sampleCount++;
+	return true;
+}
+
+void ComputePipeline::submitFrame() {
+	Resources::Frame& frame = res.frames[frameIndex];
+	VK_CHECK_RESULT(vkResetFences(vulkanDevice->logicalDevice, 1, &frame.fence));
+
+	std::vector<VkCommandBuffer> commandBuffers = { frame.commandBuffer };
+	if (profiler != nullptr) {
+		commandBuffers = { profiler->begin(profilerPass, frameIndex), frame.commandBuffer, profiler->end(profilerPass, frameIndex) };
+	}
+
+	VkSubmitInfo computeSubmitInfo = vkTools::initializers::submitInfo();
+	computeSubmitInfo.commandBufferCount = uint32_t(commandBuffers.size());
+	computeSubmitInfo.pCommandBuffers = commandBuffers.data();
+	computeSubmitInfo.signalSemaphoreCount = 1;
+	computeSubmitInfo.pSignalSemaphores = &frame.complete;
+	VK_CHECK_RESULT(vkQueueSubmit(this->res.queue, 1, &computeSubmitInfo, frame.fence));
+
+	frameIndex = (frameIndex + 1) % uint32_t(res.frames.size());
+}
+
+void ComputePipeline::writeUniformBuffer(uint32_t frame) {
+	res.uniformRing->write(frame, &res.ubo);
 }
 
-void ComputePipeline::prepareCompute(vkTools::VulkanTexture *textureComputeTarget, VkDescriptorPool *descriptorPool, VkPipelineCache* pipelineCache) {
+void ComputePipeline::prepareCompute(std::vector<vkTools::VulkanTexture> *textureComputeTargets, VkDescriptorPool *descriptorPool, VkPipelineCache* pipelineCache) {
 	VkDeviceQueueCreateInfo queueCreateInfo = {};
 	queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
 	queueCreateInfo.pNext = NULL;
 	queueCreateInfo.queueFamilyIndex = vulkanDevice->queueFamilyIndices.compute;
 	queueCreateInfo.queueCount = 1;
-	vkGetDeviceQueue(vulkanDevice->logicalDevice, vulkanDevice->queueFamilyIndices.compute, 0, &res.queue);
+	vkGetDeviceQueue(vulkanDevice->logicalDevice, vulkanDevice->queueFamilyIndices.compute, vulkanDevice->computeQueueIndex, &res.queue);
+	if (vulkanDevice->queueFamilyIndices.compute != vulkanDevice->queueFamilyIndices.graphics) {
+		std::cout << "Compute queue: dedicated family " << vulkanDevice->queueFamilyIndices.compute << std::endl;
+	} else if (vulkanDevice->computeQueueIndex > 0) {
+		std::cout << "Compute queue: second queue of the graphics family" << std::endl;
+	} else {
+		std::cout << "Compute queue: shared with graphics, frames are ray traced and presented one after another" << std::endl;
+	}
 
 	std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings = {
 		// binding 0: storage image (raytraced output)
@@ -184,16 +585,37 @@ void ComputePipeline::prepareCompute(vkTools::VulkanTexture *textureComputeTarge
 			VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
 			VK_SHADER_STAGE_COMPUTE_BIT,
 			0),
-		// binding 1: uniform buffer block
+		// binding 1: uniform buffer block, the slice of the frame is selected by a dynamic offset
 		vkTools::initializers::descriptorSetLayoutBinding(
-			VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+			VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
 			VK_SHADER_STAGE_COMPUTE_BIT,
 			1),
-		// binding 2: shader storage buffer for the voxels
+		// binding 2: shader storage buffers for the voxels, one per node segment, also read as compact node words
+		vkTools::initializers::descriptorSetLayoutBinding(
+			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			VK_SHADER_STAGE_COMPUTE_BIT,
+			2,
+			uint32_t(res.storageBuffers.voxels.size())),
+		// binding 4: brick atlas
+		vkTools::initializers::descriptorSetLayoutBinding(
+			VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+			VK_SHADER_STAGE_COMPUTE_BIT,
+			4),
+		// binding 5: brick requests and slot usage written by the shader
+		vkTools::initializers::descriptorSetLayoutBinding(
+			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			VK_SHADER_STAGE_COMPUTE_BIT,
+			5),
+		// binding 6: atlas slot of every brick
 		vkTools::initializers::descriptorSetLayoutBinding(
 			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
 			VK_SHADER_STAGE_COMPUTE_BIT,
-			2)
+			6),
+		// binding 7: storage image accumulating the samples of a still view
+		vkTools::initializers::descriptorSetLayoutBinding(
+			VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+			VK_SHADER_STAGE_COMPUTE_BIT,
+			7)
 	};
 
 	VkDescriptorSetLayoutCreateInfo descriptorLayout =
@@ -216,41 +638,76 @@ void ComputePipeline::prepareCompute(vkTools::VulkanTexture *textureComputeTarge
 			&res.descriptorSetLayout,
 			1);
 
-	VK_CHECK_RESULT(vkAllocateDescriptorSets(vulkanDevice->logicalDevice, &allocInfo, &this->res.descriptorSet));
+	// only the segments of the loaded tree are bound
+	std::vector<VkDescriptorBufferInfo> segmentDescriptors;
+	for (vk::Buffer& segment : res.storageBuffers.voxels) {
+		segmentDescriptors.push_back(segment.descriptor);
+	}
 
-	std::vector<VkWriteDescriptorSet> computeWriteDescriptorSets =
-	{
-		// binding 0: output storage image
-		vkTools::initializers::writeDescriptorSet(
-			res.descriptorSet,
-			VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
-			0,
-			&textureComputeTarget->descriptor),
-		// binding 1: uniform buffer block
-		vkTools::initializers::writeDescriptorSet(
-			res.descriptorSet,
-			VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-			1,
-			&res.uniformBuffer.descriptor),
-		// binding 2: shader storage buffer for the voxels
-		vkTools::initializers::writeDescriptorSet(
-			res.descriptorSet,
+	// the frames differ in their target
+	for (uint32_t i = 0; i < res.frames.size(); i++) {
+		VkDescriptorSet descriptorSet;
+		VK_CHECK_RESULT(vkAllocateDescriptorSets(vulkanDevice->logicalDevice, &allocInfo, &descriptorSet));
+		res.frames[i].descriptorSet = descriptorSet;
+
+		VkWriteDescriptorSet segmentWrite = vkTools::initializers::writeDescriptorSet(
+			descriptorSet,
 			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
 			2,
-			&res.storageBuffers.voxels.descriptor)
-	};
-
-	vkUpdateDescriptorSets(vulkanDevice->logicalDevice, computeWriteDescriptorSets.size(), computeWriteDescriptorSets.data(), 0, NULL);
+			segmentDescriptors.data());
+		segmentWrite.descriptorCount = uint32_t(segmentDescriptors.size());
+
+		std::vector<VkWriteDescriptorSet> computeWriteDescriptorSets =
+		{
+			// binding 0: output storage image
+			vkTools::initializers::writeDescriptorSet(
+				descriptorSet,
+				VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+				0,
+				&(*textureComputeTargets)[i].descriptor),
+			// binding 1: uniform buffer block
+			vkTools::initializers::writeDescriptorSet(
+				descriptorSet,
+				VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC,
+				1,
+				&res.uniformRing->descriptor),
+			// binding 2: shader storage buffers for the voxels, one per node segment
+			segmentWrite,
+			// binding 4: brick atlas
+			vkTools::initializers::writeDescriptorSet(
+				descriptorSet,
+				VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+				4,
+				&brickResidency->atlas.descriptor),
+			// binding 5: brick requests and slot usage written by the shader
+			vkTools::initializers::writeDescriptorSet(
+				descriptorSet,
+				VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+				5,
+				&brickResidency->feedback[i].descriptor),
+			// binding 6: atlas slot of every brick
+			vkTools::initializers::writeDescriptorSet(
+				descriptorSet,
+				VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+				6,
+				&brickResidency->slotTable.descriptor),
+			// binding 7: storage image accumulating the samples of a still view
+			vkTools::initializers::writeDescriptorSet(
+				descriptorSet,
+				VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+				7,
+				&res.accumulation.descriptor)
+		};
+
+		vkUpdateDescriptorSets(vulkanDevice->logicalDevice, computeWriteDescriptorSets.size(), computeWriteDescriptorSets.data(), 0, NULL);
+	}
 
 	// create compute shader pipelines
-	VkComputePipelineCreateInfo computePipelineCreateInfo =
-		vkTools::initializers::computePipelineCreateInfo(
-			res.pipelineLayout,
-			0);
-
-	computePipelineCreateInfo.stage = util::loadShader(vulkanDevice->logicalDevice, util::getAssetPath() + "shaders/raytracing/raytracing.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT, NULL);
-	this->shaderModule = computePipelineCreateInfo.stage.module;
-	VK_CHECK_RESULT(vkCreateComputePipelines(vulkanDevice->logicalDevice, *pipelineCache, 1, &computePipelineCreateInfo, nullptr, &this->res.pipeline));
+	this->pipelineCache = *pipelineCache;
+	this->shaderModule = util::loadShader(vulkanDevice->logicalDevice, util::getAssetPath() + "shaders/raytracing/raytracing.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT, NULL).module;
+	shaderConstants.maxLayers = uint32_t(res.ubo.octreeData.depth) + 1;
+	shaderConstants.nodeSegments = uint32_t(res.storageBuffers.voxels.size());
+	createPipeline();
 
 	VkCommandPoolCreateInfo cmdPoolInfo = {};
 	cmdPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
@@ -258,19 +715,80 @@ void ComputePipeline::prepareCompute(vkTools::VulkanTexture *textureComputeTarge
 	cmdPoolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
 	VK_CHECK_RESULT(vkCreateCommandPool(vulkanDevice->logicalDevice, &cmdPoolInfo, nullptr, &this->res.commandPool));
 
-	// create a command buffer for compute operations
+	// create a command buffer for compute operations per frame
 	VkCommandBufferAllocateInfo cmdBufAllocateInfo =
 		vkTools::initializers::commandBufferAllocateInfo(
 			res.commandPool,
 			VK_COMMAND_BUFFER_LEVEL_PRIMARY,
 			1);
 
-	VK_CHECK_RESULT(vkAllocateCommandBuffers(vulkanDevice->logicalDevice, &cmdBufAllocateInfo, &this->res.commandBuffer));
-
-	// fence for synchronization
+	// fences and semaphores for synchronization
 	VkFenceCreateInfo fenceCreateInfo = vkTools::initializers::fenceCreateInfo(VK_FENCE_CREATE_SIGNALED_BIT);
-	VK_CHECK_RESULT(vkCreateFence(vulkanDevice->logicalDevice, &fenceCreateInfo, nullptr, &this->res.fence));
+	VkSemaphoreCreateInfo semaphoreCreateInfo = vkTools::initializers::semaphoreCreateInfo();
+	for (Resources::Frame& frame : res.frames) {
+		VK_CHECK_RESULT(vkAllocateCommandBuffers(vulkanDevice->logicalDevice, &cmdBufAllocateInfo, &frame.commandBuffer));
+		VK_CHECK_RESULT(vkCreateFence(vulkanDevice->logicalDevice, &fenceCreateInfo, nullptr, &frame.fence));
+		VK_CHECK_RESULT(vkCreateSemaphore(vulkanDevice->logicalDevice, &semaphoreCreateInfo, nullptr, &frame.complete));
+	}
+
+	// build the command buffers containing the compute dispatch commands
+	buildComputeCommandBuffers(textureComputeTargets);
+}
+
+void ComputePipeline::benchmarkWorkgroupSizes(std::vector<vkTools::VulkanTexture> *textureComputeTargets) {
+	const uint32_t warmupFrames = 3;
+	const uint32_t measuredFrames = 20;
+	const std::vector<glm::uvec2> workgroupSizes = {
+		{ 8, 4 }, { 8, 8 }, { 16, 4 }, { 16, 8 }, { 8, 16 }, { 16, 16 }, { 32, 4 }, { 32, 8 }, { 64, 1 }, { 32, 32 }
+	};
 
-	// build a single command buffer containing the compute dispatch commands
-	buildComputeCommandBuffer(textureComputeTarget);
-}
\ No newline at end of file
+	// every shape renders the complete tree
+	if (uploader != nullptr) {
+		uploader->waitResident(UINT64_MAX);
+		updateStorageBufferUpload();
+	}
+	// the frames are timed one after another, all of them with the first frame's resources
+	Resources::Frame& benchmarkFrame = res.frames[0];
+	writeUniformBuffer(0);
+
+	const VkPhysicalDeviceLimits& limits = vulkanDevice->properties.limits;
+	glm::uvec2 bestSize(shaderConstants.workgroupSizeX, shaderConstants.workgroupSizeY);
+	double bestTime = std::numeric_limits<double>::max();
+	VkSubmitInfo submitInfo = vkTools::initializers::submitInfo();
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &benchmarkFrame.commandBuffer;
+	for (glm::uvec2 size : workgroupSizes) {
+		if (size.x > limits.maxComputeWorkGroupSize[0] || size.y > limits.maxComputeWorkGroupSize[1] || size.x * size.y > limits.maxComputeWorkGroupInvocations) {
+			continue;
+		}
+		VK_CHECK_RESULT(vkWaitForFences(vulkanDevice->logicalDevice, 1, &benchmarkFrame.fence, VK_TRUE, UINT64_MAX));
+		vkDestroyPipeline(vulkanDevice->logicalDevice, res.pipeline, nullptr);
+		shaderConstants.workgroupSizeX = size.x;
+		shaderConstants.workgroupSizeY = size.y;
+		createPipeline();
+		buildComputeCommandBuffers(textureComputeTargets);
+
+		std::chrono::high_resolution_clock::time_point tStart;
+		for (uint32_t frame = 0; frame < warmupFrames + measuredFrames; frame++) {
+			if (frame == warmupFrames) {
+				tStart = std::chrono::high_resolution_clock::now();
+			}
+			vkResetFences(vulkanDevice->logicalDevice, 1, &benchmarkFrame.fence);
+			VK_CHECK_RESULT(vkQueueSubmit(this->res.queue, 1, &submitInfo, benchmarkFrame.fence));
+			VK_CHECK_RESULT(vkWaitForFences(vulkanDevice->logicalDevice, 1, &benchmarkFrame.fence, VK_TRUE, UINT64_MAX));
+		}
+		double frameTime = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - tStart).count() / measuredFrames;
+		std::cout << "Workgroup " << size.x << "x" << size.y << ": " << frameTime << " ms per frame" << std::endl;
+		if (frameTime < bestTime) {
+			bestTime = frameTime;
+			bestSize = size;
+		}
+	}
+
+	vkDestroyPipeline(vulkanDevice->logicalDevice, res.pipeline, nullptr);
+	shaderConstants.workgroupSizeX = bestSize.x;
+	shaderConstants.workgroupSizeY = bestSize.y;
+	createPipeline();
+	buildComputeCommandBuffers(textureComputeTargets);
+	std::cout << "Using workgroup " << bestSize.x << "x" << bestSize.y << std::endl;
+}
@@ -12,9 +12,36 @@
 #include "vulkanTextureLoader.hpp"
 
 #include "Octree.hpp"
+#include "OctreeCache.hpp"
+#include "OctreeDag.hpp"
+#include "BrickTree.hpp"
+#include "NodeSegments.hpp"
+#include "StorageBufferUploader.h"
+#include "BrickResidency.h"
+#include "UniformRing.h"
+#include "GpuProfiler.h"
 #include "DatastructureCreator.hpp"
 #include "utility.hpp"
 
+// placement of the volume in the scene, also used for octrees built ahead of time so that they match the cache key
+const glm::vec3 OCTREE_POSITION = glm::vec3(0.0f, 0.000001f, 0.0f);
+const float OCTREE_VOXEL_FREQ = 0.001f;
+
+// traversal kernels of the compute shader, both stay selectable to compare frame times
+const uint32_t TRAVERSAL_RESTART = 0;		// walks down from the root for every voxel
+const uint32_t TRAVERSAL_PARAMETRIC = 1;	// steps through the children front to back by their ray parameters
+
+// storage buffers the nodes can be split into, has to match MAX_NODE_SEGMENTS in raytracing.comp and fit into the
+// segment bits of a node handle; only the segments of the loaded tree are bound
+const uint32_t MAX_NODE_SEGMENTS = 8;
+
+// range of the pixel error budget, also while it is adjusted to the target frame time
+const float MIN_PIXEL_ERROR = 0.25f;
+const float MAX_PIXEL_ERROR = 64.0f;
+
+// while the camera moves the pixel error budget is this much coarser, still images are refined progressively
+const float INTERACTIVE_PIXEL_ERROR_SCALE = 4.0f;
+
 class ComputePipeline {
 
 private:
@@ -24,31 +51,98 @@ private:
 	// save for cleanup
 	VkShaderModule shaderModule = VK_NULL_HANDLE;
 
+	// kept to recreate the pipeline with other shader constants
+	VkPipelineCache pipelineCache = VK_NULL_HANDLE;
+
+	// streams the octree into the storage buffer, the host copy (built tree or mapped cache) is kept until it is done
+	StorageBufferUploader* uploader = nullptr;
+	datastructure::Octree* octree = nullptr;
+	datastructure::OctreeCache* octreeCache = nullptr;
+	// one encoding per node segment
+	std::vector<datastructure::CompactNodes>* compactNodes = nullptr;
+	std::vector<datastructure::Node>* dagNodes = nullptr;
+	// copy of a tree that exceeds a single storage buffer, split into subtrees
+	datastructure::NodeSegments* nodeSegments = nullptr;
+	datastructure::BrickTree* brickTree = nullptr;
+	// the tree the bricks are gathered from, the built tree or the mapped cache
+	const datastructure::Node* brickSourceNodes = nullptr;
+	BrickResidency* brickResidency = nullptr;
+
+	// pixel error budget of still images and of frames while the camera moves, the latter is the one adapted by autoLod
+	float pixelError = 1.0f;
+	float interactivePixelError = INTERACTIVE_PIXEL_ERROR_SCALE;
+	// frame time smoothed over the last frames for the automatic level of detail
+	double lodFrameTime = 0.0;
+
+	// progressive refinement: samples accumulated for the current view, the view they were taken from and whether the
+	// last dispatch was a coarse one during camera motion
+	uint32_t sampleCount = 0;
+	glm::mat4 sampledViewMat = glm::mat4(0.0f);
+	glm::vec3 sampledPos = glm::vec3(0.0f);
+	float sampledAspectRatio = 0.0f;
+	bool viewMoved = true;
+	bool interactiveFrame = true;
+
+	// frame in res.frames that is dispatched next
+	uint32_t frameIndex = 0;
+
 	// prepares the compute shader storage buffer containing the volumetric data set
 	void prepareStorageBuffers(std::string path);
 
-	void initStorageBuffer(void* data, vk::Buffer* buffer, VkDeviceSize storageBufferSize);
+	// uploads a finished tree, with bricks, merged into a DAG or compactly encoded if enabled and split into
+	// segments if it exceeds one storage buffer; returns true if a converted copy is uploaded and the passed nodes
+	// are not needed anymore
+	bool uploadNodes(const datastructure::Node* nodes, uint64_t numNodes);
+
+	// encodes the finished tree compactly, per segment if it exceeds one storage buffer, and uploads it completely;
+	// returns false if the tree cannot be encoded
+	bool uploadCompactNodes(const datastructure::Node* nodes, uint64_t numNodes);
+
+	// fills the octree part of the compute UBO, the values come from a fresh build or from the cache
+	void setOctreeData(const datastructure::OctreeLayout& layout);
+
+	// blocks until the top levels of the tree are resident so that rendering can start
+	void waitForTopLevels();
+
+	// copies the resident part of the tree into the UBO, returns true if it has changed
+	bool updateResidentNodes();
+
+	// creates the brick pool, a single transparent texel and empty tables if bricks are not used
+	void prepareBrickResidency();
 
 	// prepares the uniform buffer containing shader uniforms
 	void prepareUniformBuffers();
 
+	// copies the changes of the uniform block into the slice read by a frame
+	void writeUniformBuffer(uint32_t frame);
+
 	// prepares the texture target that is used to store the rendering of the compute shader
 	void prepareTextureTarget(vkTools::VulkanTexture *tex, uint32_t width, uint32_t height, VkFormat format);
 
-	void buildComputeCommandBuffer(vkTools::VulkanTexture *textureComputeTarget);
+	// creates the compute pipeline from the loaded shader module, specialized with shaderConstants
+	void createPipeline();
+
+	// records the dispatch of every frame into its target, textureComputeTargets has one texture per frame
+	void buildComputeCommandBuffers(std::vector<vkTools::VulkanTexture> *textureComputeTargets);
 
 public:
 	struct Resources {
 		struct StorageBuffers {
-			vk::Buffer voxels;
+			std::vector<vk::Buffer> voxels;		// node segments, see StorageBufferUploader
 		} storageBuffers;
-		vk::Buffer uniformBuffer;					// scene data
+		UniformRing* uniformRing = nullptr;			// scene data, one slice per frame
+		vkTools::VulkanTexture accumulation;		// sum of the samples of a still view
 		VkQueue queue;								// queue for compute commands
 		VkCommandPool commandPool;					// compute command pool
-		VkCommandBuffer commandBuffer;				// stores the dispatch commands and barriers
-		VkFence fence;								// fence to avoid rewriting compute CB if still in use
+		// consecutive dispatches cycle through the frames, so that the next one is prepared while the last ones are still executed
+		struct Frame {
+			VkCommandBuffer commandBuffer;			// stores the dispatch commands and barriers
+			VkFence fence;							// fence to avoid rewriting the uniform slice or the compute CB if still in use
+			VkSemaphore complete;					// signaled when the dispatch has finished, the frame that presents it waits for it
+			VkDescriptorSet descriptorSet;			// compute shader bindings with the target of the frame
+		};
+		std::vector<Frame> frames;
 		VkDescriptorSetLayout descriptorSetLayout;	// compute shader binding layout
-		VkDescriptorSet descriptorSet;				// compute shader bindings
 		VkPipelineLayout pipelineLayout;			// layout of the compute pipeline
 		VkPipeline pipeline;						// compute raytracing pipeline
 		struct UBOCompute {							// compute shader uniform block object
@@ -56,10 +150,28 @@ public:
 			float aspectRatio;
 			glm::mat4 viewMat = glm::mat4(0.0f);
 			struct OctreeData {
-				glm::vec3 pos;
+				glm::vec3 pos;						// center of the root node
 				float voxelFreq;
-				int32_t numVoxelsSide;
-				float _pad[3];
+				glm::vec3 voxelSize;				// extent of a voxel per axis
+				int32_t numVoxelsSide;				// padded to a power of two
+				glm::ivec3 dims;					// extent of the volume without padding
+				int32_t depth;
+				uint32_t residentNodes = 0;			// the segments are filled one after another and front to back
+				uint32_t residentSegments = 0;		// while rendering, these are completely resident
+				uint32_t traversal = TRAVERSAL_PARAMETRIC;
+				uint32_t encoding = datastructure::NODE_ENCODING_STANDARD;
+				uint32_t brickLevel = UINT32_MAX;	// level of the nodes whose voxels are stored in bricks, none by default
+				uint32_t brickSize = datastructure::BRICK_SIZE;
+				uint32_t brickAtlasWidth = 1;		// bricks per atlas row and column
+				uint32_t brickAtlasHeight = 1;
+				uint32_t frame = 0;					// stamps the atlas slots sampled by this frame
+				float pixelError = 1.0f;			// nodes are refined while they cover more pixels than this
+				glm::vec2 jitter = glm::vec2(0.0f);	// sub-pixel position of the sample in [0, 1)
+				uint32_t sampleIndex = 0;			// samples accumulated before this one, 0 restarts the accumulation
+				uint32_t padding[3] = {};
+				// compact encoding, word offsets within every segment, four segments per vector
+				glm::uvec4 farPointerOffsets[MAX_NODE_SEGMENTS / 4] = {};
+				glm::uvec4 attributeOffsets[MAX_NODE_SEGMENTS / 4] = {};
 			} octreeData;
 			struct Camera {
 				glm::vec3 pos = glm::vec3(0.0f, 0.0f, 4.0f);
@@ -69,16 +181,116 @@ public:
 		} ubo;
 	} res;
 
+	// threads used to build the octree, 0 uses all hardware threads
+	uint32_t octreeBuildThreads = 0;
+
+	// reuse and write the octree cache file next to the data set (<path>.octree)
+	bool useOctreeCache = true;
+
+	// upload the tree in the compact encoding (grey scale volumes only), which is read with a third of the bandwidth
+	// but cannot be rendered before the whole tree is resident
+	bool compactNodeEncoding = false;
+
+	// merge identical subtrees into a directed acyclic graph before uploading, subtrees whose colors differ
+	// by at most dagColorTolerance per channel are merged as well
+	bool useOctreeDag = false;
+	uint32_t dagColorTolerance = 0;
+
+	// end the tree in bricks of BRICK_SIZE^3 voxels that the parametric kernel ray marches with trilinear filtering,
+	// they are paged into a pool on demand; replaces the DAG and the compact encoding
+	bool useBricks = false;
+
+	// device memory of the brick atlas, bricks beyond it are paged in when the shader requests them
+	VkDeviceSize brickPoolSize = 256 * 1024 * 1024;
+
+	// bricks gathered and uploaded per frame at most
+	uint32_t brickLoadsPerFrame = 256;
+
+	// bytes per storage buffer the nodes are split into, 0 uses the largest binding range of the device
+	VkDeviceSize nodeSegmentSize = 0;
+
+	// adjust the pixel error budget while the camera moves so that the frame time approaches targetFrameTime (ms)
+	bool autoLod = false;
+	float targetFrameTime = 16.0f;
+
+	// accumulate jittered samples at the finer budget once the camera stops, nothing is dispatched after maxSamples;
+	// without it every view is rendered once at the interactive budget
+	bool progressive = true;
+	uint32_t maxSamples = 16;
+
+	// times the dispatches with a slot per frame if set
+	GpuProfiler *profiler = nullptr;
+	uint32_t profilerPass = 0;
+
+	// specialization constants of raytracing.comp (constant_id 0-5), applied when the pipeline is created
+	struct ShaderConstants {
+		uint32_t workgroupSizeX = 16;
+		uint32_t workgroupSizeY = 16;
+		uint32_t maxLayers = datastructure::MAX_OCTREE_DEPTH + 1;	// path length, set to the depth of the loaded tree + 1 in prepareCompute
+		float maxLength = 1000.0f;					// farthest ray hit
+		float brickStep = 0.5f;						// ray marching step inside bricks in voxels
+		uint32_t nodeSegments = MAX_NODE_SEGMENTS;			// node storage buffers, set to the segments of the loaded tree in prepareCompute
+	} shaderConstants;
+
 	ComputePipeline(vk::VulkanDevice *vulkanDevice,
 		VkQueue *queue);
 
 	~ComputePipeline();
 
-	void prepare(std::string path, vkTools::VulkanTexture *tex, uint32_t width, uint32_t height);
+	// loads the data set and creates one target texture and set of per frame resources for each element of textureComputeTargets
+	void prepare(std::string path, std::vector<vkTools::VulkanTexture> *textureComputeTargets, uint32_t width, uint32_t height);
+
+	// continues the octree upload without blocking, has to be called once per frame until it is finished
+	void updateStorageBufferUpload();
+
+	// pages in the bricks requested by the last frame, has to be called once per frame before the dispatch is submitted
+	void updateBrickResidency();
 
+	// sets the view of the next frame, the uniform buffer is written by prepareFrame()
 	void updateUniformBuffers(glm::mat4 viewMat, glm::vec3 pos);
 
+	// switches between the restart and the parametric traversal kernel
+	void toggleTraversal();
+
+	// sets the number of pixels a node may cover before it is refined, clamped to MIN_PIXEL_ERROR - MAX_PIXEL_ERROR;
+	// frames during camera motion use INTERACTIVE_PIXEL_ERROR_SCALE times as much if progressive is enabled
+	void setPixelError(float pixelError);
+
+	float getPixelError() const {
+		return pixelError;
+	}
+
+	void toggleAutoLod();
+
+	void toggleProgressive();
+
+	// true while the tree is uploaded, frames have to be rendered when more of it becomes resident
+	bool backgroundWorkPending() const {
+		return uploader != nullptr;
+	}
+
+	// discards the accumulated samples, e.g. when more of the tree has become resident
+	void restartAccumulation();
+
+	// waits until the resources of the next frame are free and sets up its sample, returns false if the still image has
+	// converged and nothing has to be dispatched
+	bool prepareFrame();
+
+	// submits the dispatch set up by prepareFrame() and advances to the next frame, the dispatch writes the target
+	// getFrameIndex() returned before and signals res.frames[getFrameIndex()].complete
+	void submitFrame();
+
+	uint32_t getFrameIndex() const {
+		return frameIndex;
+	}
+
+	// adapts the interactive pixel error to the time of the last frame if autoLod is enabled
+	void updateLod(double frameTime);
+
 	// prepare the compute pipeline that generates the ray traced image
-	void prepareCompute(vkTools::VulkanTexture *textureComputeTarget, VkDescriptorPool *descriptorPool, VkPipelineCache* pipelineCache);
+	void prepareCompute(std::vector<vkTools::VulkanTexture> *textureComputeTargets, VkDescriptorPool *descriptorPool, VkPipelineCache* pipelineCache);
+
+	// renders the current view with several workgroup shapes, prints the timings and keeps the fastest shape
+	void benchmarkWorkgroupSizes(std::vector<vkTools::VulkanTexture> *textureComputeTargets);
 };
 
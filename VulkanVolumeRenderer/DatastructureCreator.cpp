@@ -4,36 +4,205 @@
 
 #include "DatastructureCreator.hpp"
 
+#include <bitset>
+#include <chrono>
+
+#include "MappedFile.hpp"
+#include "Parallel.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VOXEL_PARSER_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 namespace datastructure {
 
-	void loadVoxelDataFromTxt(std::string filePath, std::vector<uint32_t>* voxelData) {
-		std::ifstream fin(filePath, std::ifstream::in);
-
-		if (fin.is_open()) {
-			char c;
-			char buffer[3];
-			int pos = 0;
-			int intColor;
-			while (fin >> c) {
-				if (c == ';') {
-					std::sscanf(buffer, "%d", &intColor);
-					int alpha = 255;
-					if (intColor == 0) {
-						alpha = 0;
-					}
-					uint32_t color = vec4ToInt(glm::vec4(intColor, intColor, intColor, intColor));
-					pos = 0;
-					std::fill_n(buffer, 3, NULL);
-					voxelData->push_back(color);
-				} else {
-					buffer[pos++] = c;
+	namespace {
+		const char VALUE_SEPARATOR = ';';
+		const uint32_t MAX_VALUE_DIGITS = 3;
+		const uint32_t MAX_VALUE = 255;
+		const uint64_t NO_ERROR_OFFSET = UINT64_MAX;
+
+		struct ParseError {
+			uint64_t offset = NO_ERROR_OFFSET;	// byte offset of the offending value in the file
+			uint64_t voxel = 0;					// index of the offending value
+			const char* reason = "";
+		};
+
+		uint32_t countTrailingZeros(uint32_t mask) {
+#if defined(_MSC_VER)
+			unsigned long idx;
+			_BitScanForward(&idx, mask);
+			return uint32_t(idx);
+#else
+			return uint32_t(__builtin_ctz(mask));
+#endif
+		}
+
+		bool isWhitespace(char c) {
+			return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+		}
+
+		uint64_t countSeparators(const char* data, uint64_t begin, uint64_t end) {
+			uint64_t count = 0;
+			uint64_t pos = begin;
+#ifdef VOXEL_PARSER_SSE2
+			const __m128i separator = _mm_set1_epi8(VALUE_SEPARATOR);
+			for (; pos + 16 <= end; pos += 16) {
+				__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+				uint32_t mask = uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(block, separator)));
+				count += std::bitset<16>(mask).count();
+			}
+#endif
+			for (; pos < end; pos++) {
+				count += data[pos] == VALUE_SEPARATOR;
+			}
+			return count;
+		}
+
+		// returns the position of the next separator in [pos, end) or end if there is none
+		uint64_t findSeparator(const char* data, uint64_t pos, uint64_t end) {
+#ifdef VOXEL_PARSER_SSE2
+			const __m128i separator = _mm_set1_epi8(VALUE_SEPARATOR);
+			for (; pos + 16 <= end; pos += 16) {
+				__m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+				uint32_t mask = uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(block, separator)));
+				if (mask != 0) {
+					return pos + countTrailingZeros(mask);
+				}
+			}
+#endif
+			for (; pos < end; pos++) {
+				if (data[pos] == VALUE_SEPARATOR) {
+					return pos;
+				}
+			}
+			return end;
+		}
+
+		// parses a single value in [begin, end), surrounding whitespace is allowed like with stream extraction
+		// values have at most 3 digits, so they are parsed scalar; only the separator search is vectorized
+		bool parseValue(const char* data, uint64_t begin, uint64_t end, uint32_t* value, const char** reason) {
+			while (begin < end && isWhitespace(data[begin])) {
+				begin++;
+			}
+			while (end > begin && isWhitespace(data[end - 1])) {
+				end--;
+			}
+			if (begin == end) {
+				*reason = "empty value";
+				return false;
+			}
+			if (end - begin > MAX_VALUE_DIGITS) {
+				*reason = "value has more than 3 digits";
+				return false;
+			}
+
+			uint32_t result = 0;
+			for (uint64_t pos = begin; pos < end; pos++) {
+				if (data[pos] < '0' || data[pos] > '9') {
+					*reason = "value is not a non-negative integer";
+					return false;
 				}
+				result = result * 10 + uint32_t(data[pos] - '0');
+			}
+			if (result > MAX_VALUE) {
+				*reason = "value exceeds 255";
+				return false;
 			}
-			fin.close();
-		} else {
+			*value = result;
+			return true;
+		}
+
+		// parses all values of [begin, end) into out, end is located directly behind a separator
+		ParseError parseChunk(const char* data, uint64_t begin, uint64_t end, uint32_t* out, uint64_t firstVoxel) {
+			ParseError error;
+			uint64_t voxel = 0;
+			uint64_t pos = begin;
+			while (pos < end) {
+				uint64_t separator = findSeparator(data, pos, end);
+				uint32_t value;
+				if (!parseValue(data, pos, separator, &value, &error.reason)) {
+					error.offset = pos;
+					error.voxel = firstVoxel + voxel;
+					return error;
+				}
+				// the gray value is replicated into all channels, including alpha
+				out[voxel++] = value * 0x01010101u;
+				pos = separator + 1;
+			}
+			return error;
+		}
+	}
+
+	bool loadVoxelDataFromTxt(std::string filePath, std::vector<uint32_t>* voxelData) {
+		auto tStart = std::chrono::high_resolution_clock::now();
+
+		util::MappedFile file;
+		if (!file.open(filePath)) {
 			std::cout << "Unable to open file!" << std::endl;
+			return false;
+		}
+		const char* data = reinterpret_cast<const char*>(file.data());
+		uint64_t size = file.size();
+
+		// everything after the last separator is not a complete value
+		uint64_t end = size;
+		while (end > 0 && data[end - 1] != VALUE_SEPARATOR) {
+			end--;
+		}
+		for (uint64_t pos = end; pos < size; pos++) {
+			if (!isWhitespace(data[pos])) {
+				std::cout << "Ignoring trailing data without separator at byte " << pos << " of " << filePath << std::endl;
+				break;
+			}
+		}
+
+		// split the file into one chunk per thread, every chunk boundary lies directly behind a separator
+		uint32_t numChunks = uint32_t(std::max<uint64_t>(1, std::min<uint64_t>(util::defaultThreadCount(), end / 4096)));
+		std::vector<uint64_t> chunkStart(numChunks + 1);
+		chunkStart[0] = 0;
+		chunkStart[numChunks] = end;
+		for (uint32_t i = 1; i < numChunks; i++) {
+			uint64_t boundary = std::max(chunkStart[i - 1], end * i / numChunks);
+			chunkStart[i] = std::min(end, findSeparator(data, boundary, end) + 1);
+		}
+
+		// first pass counts the values per chunk, so that every chunk knows where its output starts
+		std::vector<uint64_t> chunkVoxels(numChunks + 1, 0);
+		util::parallelFor(numChunks, numChunks, [&](uint32_t i) {
+			chunkVoxels[i + 1] = countSeparators(data, chunkStart[i], chunkStart[i + 1]);
+		});
+		for (uint32_t i = 0; i < numChunks; i++) {
+			chunkVoxels[i + 1] += chunkVoxels[i];
 		}
+
+		voxelData->resize(chunkVoxels[numChunks]);
+		uint32_t* out = voxelData->data();
+
+		// second pass writes each chunk directly into its range of the presized output
+		std::vector<ParseError> errors(numChunks);
+		util::parallelFor(numChunks, numChunks, [&](uint32_t i) {
+			errors[i] = parseChunk(data, chunkStart[i], chunkStart[i + 1], out + chunkVoxels[i], chunkVoxels[i]);
+		});
+
+		for (const ParseError& error : errors) {
+			if (error.offset != NO_ERROR_OFFSET) {
+				std::cout << "Invalid voxel " << error.voxel << " at byte " << error.offset << " of " << filePath << ": " << error.reason << std::endl;
+				voxelData->clear();
+				return false;
+			}
+		}
+
+		auto tEnd = std::chrono::high_resolution_clock::now();
+		double seconds = std::chrono::duration<double>(tEnd - tStart).count();
+		std::cout << "Parsed " << voxelData->size() << " voxels (" << size / 1000000.0 << " MB) in " << seconds * 1000.0 << " ms, "
+			<< size / 1000000000.0 / seconds << " GB/s on " << numChunks << " threads" << std::endl;
+		return true;
 	}
 
 	glm::uvec4 intToVec4(uint32_t number) {
@@ -7,7 +7,8 @@
 #include "Octree.hpp"
 
 namespace datastructure {
-	void loadVoxelDataFromTxt(std::string filePath, std::vector<uint32_t>* voxelData);
+	// parses a semicolon separated gray value file in parallel, returns false and clears voxelData on malformed input
+	bool loadVoxelDataFromTxt(std::string filePath, std::vector<uint32_t>* voxelData);
 	
 	glm::uvec4 intToVec4(uint32_t rawValue);
 
@@ -0,0 +1,120 @@
+#include "GpuProfiler.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include "utility.hpp"
+
+// public
+
+GpuProfiler::GpuProfiler(vk::VulkanDevice *vulkanDevice, uint32_t numSlots) {
+	this->vulkanDevice = vulkanDevice;
+	this->numSlots = numSlots;
+}
+
+GpuProfiler::~GpuProfiler() {
+	for (Pass& pass : passes) {
+		vkDestroyCommandPool(vulkanDevice->logicalDevice, pass.commandPool, nullptr);
+		vkDestroyQueryPool(vulkanDevice->logicalDevice, pass.queryPool, nullptr);
+	}
+}
+
+uint32_t GpuProfiler::addPass(std::string name, uint32_t queueFamily) {
+	Pass pass;
+	pass.name = name;
+	uint32_t validBits = vulkanDevice->queueFamilyProperties[queueFamily].timestampValidBits;
+	pass.supported = validBits > 0;
+	pass.timestampMask = validBits >= 64 ? UINT64_MAX : (uint64_t(1) << validBits) - 1;
+	if (!pass.supported) {
+		std::cout << "Profiler: queue family " << queueFamily << " does not support timestamps, " << name << " is not measured" << std::endl;
+	}
+
+	// a pair of timestamps per slot
+	VkQueryPoolCreateInfo queryPoolInfo = {};
+	queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	queryPoolInfo.queryCount = 2 * numSlots;
+	VK_CHECK_RESULT(vkCreateQueryPool(vulkanDevice->logicalDevice, &queryPoolInfo, nullptr, &pass.queryPool));
+
+	// the command buffers never change, they are recorded once
+	pass.commandPool = vulkanDevice->createCommandPool(queueFamily, 0);
+	pass.beginCommandBuffers.resize(numSlots);
+	pass.endCommandBuffers.resize(numSlots);
+	VkCommandBufferBeginInfo cmdBufInfo = vkTools::initializers::commandBufferBeginInfo();
+	for (uint32_t slot = 0; slot < numSlots; slot++) {
+		VkCommandBuffer beginCmd = util::createCommandBuffer(vulkanDevice->logicalDevice, pass.commandPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, false);
+		VK_CHECK_RESULT(vkBeginCommandBuffer(beginCmd, &cmdBufInfo));
+		if (pass.supported) {
+			vkCmdResetQueryPool(beginCmd, pass.queryPool, 2 * slot, 2);
+			vkCmdWriteTimestamp(beginCmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, pass.queryPool, 2 * slot);
+		}
+		VK_CHECK_RESULT(vkEndCommandBuffer(beginCmd));
+
+		VkCommandBuffer endCmd = util::createCommandBuffer(vulkanDevice->logicalDevice, pass.commandPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, false);
+		VK_CHECK_RESULT(vkBeginCommandBuffer(endCmd, &cmdBufInfo));
+		if (pass.supported) {
+			// written once all commands submitted before have completed
+			vkCmdWriteTimestamp(endCmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, pass.queryPool, 2 * slot + 1);
+		}
+		VK_CHECK_RESULT(vkEndCommandBuffer(endCmd));
+
+		pass.beginCommandBuffers[slot] = beginCmd;
+		pass.endCommandBuffers[slot] = endCmd;
+	}
+	pass.pending.assign(numSlots, false);
+	passes.push_back(pass);
+	return uint32_t(passes.size() - 1);
+}
+
+VkCommandBuffer GpuProfiler::begin(uint32_t pass, uint32_t slot) {
+	passes[pass].pending[slot] = true;
+	return passes[pass].beginCommandBuffers[slot];
+}
+
+VkCommandBuffer GpuProfiler::end(uint32_t pass, uint32_t slot) {
+	return passes[pass].endCommandBuffers[slot];
+}
+
+void GpuProfiler::collect(uint32_t pass, uint32_t slot) {
+	Pass& p = passes[pass];
+	if (!p.pending[slot]) {
+		return;
+	}
+	p.pending[slot] = false;
+	if (!p.supported) {
+		return;
+	}
+
+	uint64_t timestamps[2];
+	VkResult result = vkGetQueryPoolResults(vulkanDevice->logicalDevice, p.queryPool, 2 * slot, 2, sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+	if (result != VK_SUCCESS) {
+		return;
+	}
+	// the counter wraps around after timestampValidBits, timestampPeriod is in ns per tick
+	double duration = double((timestamps[1] - timestamps[0]) & p.timestampMask) * vulkanDevice->properties.limits.timestampPeriod / 1000000.0;
+	if (p.history.size() < PROFILER_HISTORY) {
+		p.history.push_back(duration);
+	} else {
+		p.history[p.nextSample] = duration;
+	}
+	p.nextSample = (p.nextSample + 1) % PROFILER_HISTORY;
+}
+
+GpuProfiler::Stats GpuProfiler::getStats(uint32_t pass) const {
+	Stats stats;
+	std::vector<double> sorted = passes[pass].history;
+	if (sorted.empty()) {
+		return stats;
+	}
+	std::sort(sorted.begin(), sorted.end());
+	double sum = 0.0;
+	for (double duration : sorted) {
+		sum += duration;
+	}
+	stats.samples = uint32_t(sorted.size());
+	stats.min = sorted.front();
+	stats.max = sorted.back();
+	stats.avg = sum / sorted.size();
+	stats.p95 = sorted[std::min(sorted.size() - 1, size_t(sorted.size() * 0.95))];
+	return stats;
+}
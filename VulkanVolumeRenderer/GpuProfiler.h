@@ -0,0 +1,71 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "vulkantools.h"
+#include "vulkandevice.hpp"
+
+// GPU times of the last frames kept per pass
+const uint32_t PROFILER_HISTORY = 120;
+
+// measures the GPU time of passes with timestamp queries: a pass is submitted between the command buffers returned
+// by begin() and end() in the same batch, which write a timestamp before and after the commands of the pass. Every
+// pass has a query pair per slot (e.g. per frame in flight), a slot is read by collect() once the batch has finished
+// and its duration is added to a rolling history of the last PROFILER_HISTORY submissions.
+class GpuProfiler {
+public:
+	struct Stats {
+		double min = 0.0;		// ms
+		double avg = 0.0;
+		double p95 = 0.0;
+		double max = 0.0;
+		uint32_t samples = 0;	// 0 if the pass has not been measured (yet)
+	};
+
+private:
+	struct Pass {
+		std::string name;
+		bool supported;							// the queue family writes timestamps
+		uint64_t timestampMask;
+		VkQueryPool queryPool;
+		VkCommandPool commandPool;
+		std::vector<VkCommandBuffer> beginCommandBuffers;
+		std::vector<VkCommandBuffer> endCommandBuffers;
+		std::vector<bool> pending;				// the slot has been handed out by begin() and not been read yet
+		std::vector<double> history;			// ring of durations in ms
+		uint32_t nextSample = 0;
+	};
+
+	vk::VulkanDevice *vulkanDevice;
+	uint32_t numSlots;
+	std::vector<Pass> passes;
+
+public:
+	GpuProfiler(vk::VulkanDevice *vulkanDevice, uint32_t numSlots);
+
+	~GpuProfiler();
+
+	// adds a pass submitted to a queue of queueFamily and returns its index
+	uint32_t addPass(std::string name, uint32_t queueFamily);
+
+	// command buffers to submit right before and after the commands of the pass, the slot must have been collected
+	VkCommandBuffer begin(uint32_t pass, uint32_t slot);
+	VkCommandBuffer end(uint32_t pass, uint32_t slot);
+
+	// adds the duration measured in slot to the history, the batch of the slot has to be finished (e.g. its fence waited)
+	void collect(uint32_t pass, uint32_t slot);
+
+	uint32_t getNumPasses() const {
+		return uint32_t(passes.size());
+	}
+
+	const std::string& getName(uint32_t pass) const {
+		return passes[pass].name;
+	}
+
+	// min, average, 95th percentile and max over the history
+	Stats getStats(uint32_t pass) const;
+};
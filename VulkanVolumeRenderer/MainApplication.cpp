@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string>
 #include <assert.h>
+#include <cctype>
 #include <vector>
 
 #define GLM_FORCE_RADIANS
@@ -12,6 +13,7 @@
 #include "VulkanBase.h"
 
 #include "ComputePipeline.h"
+#include "OctreeStreamBuilder.hpp"
 
 #define ENABLE_VALIDATION false
 
@@ -24,13 +26,48 @@ private:
 	ComputePipeline *computePipeline;
 
 public:
-	vkTools::VulkanTexture textureComputeTarget;
+	// upload the octree in the compact node encoding (--compact)
+	bool compactNodeEncoding = false;
+
+	// merge identical subtrees into a DAG, optionally within a color tolerance (--dag [tolerance])
+	bool useOctreeDag = false;
+	uint32_t dagColorTolerance = 0;
+
+	// end the tree in bricks sampled from a 3D texture atlas (--bricks), paged through a pool of brickPoolSize bytes (--brick-pool MB)
+	bool useBricks = false;
+	VkDeviceSize brickPoolSize = 256 * 1024 * 1024;
+
+	// split the nodes into storage buffers of at most this many bytes, 0 uses the device limit (--node-segment MB)
+	VkDeviceSize nodeSegmentSize = 0;
+
+	// pixels a node may cover before it is refined (--pixel-error px), adjusted to a frame time if one is given (--target-ms ms)
+	float pixelError = 1.0f;
+	float targetFrameTime = 0.0f;
+
+	// render continuously instead of only when the image changes (--continuous)
+	bool continuousRendering = false;
+
+	// samples accumulated for a still view, 0 renders every frame once at the interactive budget (--samples n)
+	uint32_t maxSamples = 16;
+
+	// time the compute pass with several workgroup shapes on startup and keep the fastest (--sweep-workgroups)
+	bool sweepWorkgroupSizes = false;
+
+	// threads building the octree and gathering bricks, 0 uses all hardware threads (--threads n)
+	uint32_t octreeBuildThreads = 0;
+
+	// one target per frame in flight, the dispatches write them in turn while the last finished one is displayed
+	std::vector<vkTools::VulkanTexture> textureComputeTargets = std::vector<vkTools::VulkanTexture>(MAX_FRAMES_IN_FLIGHT);
+	uint32_t displayedTarget = 0;
+
+	// profiler pass of the fullscreen pass that displays the compute target
+	uint32_t blitPass = 0;
 
 	// graphics resources
 	struct {
 		VkDescriptorSetLayout descriptorSetLayout;
 		VkDescriptorSet descriptorSetPreCompute;
-		VkDescriptorSet descriptorSet;
+		std::array<VkDescriptorSet, MAX_FRAMES_IN_FLIGHT> descriptorSets;	// samples the compute target of the same index
 		VkPipeline pipeline;
 		VkPipelineLayout pipelineLayout;
 	} graphics;
@@ -59,19 +96,43 @@ public:
 		// compute
 		delete computePipeline;
 
-		textureLoader->destroyTexture(textureComputeTarget);
+		for (vkTools::VulkanTexture& target : textureComputeTargets) {
+			textureLoader->destroyTexture(target);
+		}
 	}
 
 	void prepare() {
 		VulkanBase::prepare();
 		computePipeline = new ComputePipeline(vulkanDevice, &queue);
 		computePipeline->res.ubo.aspectRatio = (float)width / (float)height;
-		computePipeline->prepare(path, &textureComputeTarget, TEX_WIDTH, TEX_HEIGHT);
+		computePipeline->compactNodeEncoding = compactNodeEncoding;
+		computePipeline->useOctreeDag = useOctreeDag;
+		computePipeline->dagColorTolerance = dagColorTolerance;
+		computePipeline->useBricks = useBricks;
+		computePipeline->brickPoolSize = brickPoolSize;
+		computePipeline->nodeSegmentSize = nodeSegmentSize;
+		computePipeline->octreeBuildThreads = octreeBuildThreads;
+		renderOnDemand = !continuousRendering;
+		computePipeline->progressive = maxSamples > 0;
+		computePipeline->maxSamples = maxSamples;
+		computePipeline->setPixelError(pixelError);
+		if (targetFrameTime > 0.0f) {
+			computePipeline->targetFrameTime = targetFrameTime;
+			computePipeline->toggleAutoLod();
+		}
+		computePipeline->profiler = profiler;
+		computePipeline->profilerPass = profiler->addPass("ray tracing", vulkanDevice->queueFamilyIndices.compute);
+		blitPass = profiler->addPass("fullscreen blit", vulkanDevice->queueFamilyIndices.graphics);
+		computePipeline->prepare(path, &textureComputeTargets, TEX_WIDTH, TEX_HEIGHT);
 		setupDescriptorSetLayout();
 		preparePipelines();
 		setupDescriptorPool();
 		setupDescriptorSet();
-		computePipeline->prepareCompute(&textureComputeTarget, &descriptorPool, &pipelineCache);
+		computePipeline->prepareCompute(&textureComputeTargets, &descriptorPool, &pipelineCache);
+		if (sweepWorkgroupSizes) {
+			computePipeline->updateUniformBuffers(camera.matrices.view, camera.position);
+			computePipeline->benchmarkWorkgroupSizes(&textureComputeTargets);
+		}
 		buildCommandBuffers();
 		prepared = true;
 	}
@@ -186,17 +247,18 @@ public:
 	void setupDescriptorPool() {
 		std::vector<VkDescriptorPoolSize> poolSizes =
 		{
-			vkTools::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2),			// compute UBO
-			vkTools::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 4),	// graphics image samplers
-			vkTools::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1),				// storage image for ray traced image output
-			vkTools::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1),			// storage buffer for the voxels
+			// the compute and the graphics sets exist once per frame in flight
+			vkTools::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, MAX_FRAMES_IN_FLIGHT),	// compute UBO
+			vkTools::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2 * MAX_FRAMES_IN_FLIGHT),	// graphics image samplers and the brick atlas
+			vkTools::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 2 * MAX_FRAMES_IN_FLIGHT),		// storage images for ray traced image output and accumulation
+			vkTools::initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, uint32_t(computePipeline->res.storageBuffers.voxels.size() + 2) * MAX_FRAMES_IN_FLIGHT),	// node segments of the loaded tree, brick feedback and slots
 		};
 
 		VkDescriptorPoolCreateInfo descriptorPoolInfo =
 			vkTools::initializers::descriptorPoolCreateInfo(
 				poolSizes.size(),
 				poolSizes.data(),
-				3);
+				2 * MAX_FRAMES_IN_FLIGHT);
 
 		VK_CHECK_RESULT(vkCreateDescriptorPool(device, &descriptorPoolInfo, nullptr, &descriptorPool));
 	}
@@ -208,19 +270,21 @@ public:
 				&graphics.descriptorSetLayout,
 				1);
 
-		VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &graphics.descriptorSet));
+		for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+			VK_CHECK_RESULT(vkAllocateDescriptorSets(device, &allocInfo, &graphics.descriptorSets[i]));
 
-		std::vector<VkWriteDescriptorSet> writeDescriptorSets =
-		{
-			// Binding 0 : Fragment shader texture sampler
-			vkTools::initializers::writeDescriptorSet(
-				graphics.descriptorSet,
-				VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
-				0,
-				&textureComputeTarget.descriptor)
-		};
+			std::vector<VkWriteDescriptorSet> writeDescriptorSets =
+			{
+				// Binding 0 : Fragment shader texture sampler
+				vkTools::initializers::writeDescriptorSet(
+					graphics.descriptorSets[i],
+					VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+					0,
+					&textureComputeTargets[i].descriptor)
+			};
 
-		vkUpdateDescriptorSets(device, writeDescriptorSets.size(), writeDescriptorSets.data(), 0, NULL);
+			vkUpdateDescriptorSets(device, writeDescriptorSets.size(), writeDescriptorSets.data(), 0, NULL);
+		}
 	}
 
 
@@ -247,29 +311,17 @@ public:
 		renderPassBeginInfo.clearValueCount = 2;
 		renderPassBeginInfo.pClearValues = clearValues;
 
+		// one command buffer per compute target and swap chain image
 		for (int32_t i = 0; i < drawCmdBuffers.size(); ++i) {
+			uint32_t target = i / swapChain.imageCount;
+
 			// sets the target frame buffer
-			renderPassBeginInfo.framebuffer = frameBuffers[i];
+			renderPassBeginInfo.framebuffer = frameBuffers[i % swapChain.imageCount];
 
 			VK_CHECK_RESULT(vkBeginCommandBuffer(drawCmdBuffers[i], &cmdBufInfo));
 
-			// barrier to ensure that the write operations from the compute shader are finished before sampling from the texture
-			VkImageMemoryBarrier imageMemoryBarrier = {};
-			imageMemoryBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-			imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
-			imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-			imageMemoryBarrier.image = textureComputeTarget.image;
-			imageMemoryBarrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
-			imageMemoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
-			imageMemoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-			vkCmdPipelineBarrier(
-				drawCmdBuffers[i],
-				VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-				VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
-				VK_FLAGS_NONE,
-				0, nullptr,
-				0, nullptr,
-				1, &imageMemoryBarrier);
+			// no barrier for the compute target: it is written on the compute queue, the submission waits for the
+			// semaphore of the dispatch (see draw()) and the target stays in the general layout on both queues
 
 			vkCmdBeginRenderPass(drawCmdBuffers[i], &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
 
@@ -280,7 +332,7 @@ public:
 			vkCmdSetScissor(drawCmdBuffers[i], 0, 1, &scissor);
 
 			// display ray traced image generated by compute shader as a full screen quad, the quad vertices are generated in the vertex shader
-			vkCmdBindDescriptorSets(drawCmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, graphics.pipelineLayout, 0, 1, &graphics.descriptorSet, 0, NULL);
+			vkCmdBindDescriptorSets(drawCmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, graphics.pipelineLayout, 0, 1, &graphics.descriptorSets[target], 0, NULL);
 			vkCmdBindPipeline(drawCmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, graphics.pipeline);
 			vkCmdDraw(drawCmdBuffers[i], 3, 1, 0, 0);
 
@@ -291,35 +343,80 @@ public:
 
 	}
 
-	void draw() {
+	// the compute dispatch is skipped once the still image has converged, the last result is presented again
+	void draw(bool dispatchCompute) {
+		// waits for the frame MAX_FRAMES_IN_FLIGHT before; the compute target written next has last been displayed
+		// before that frame, so no frame in flight samples it anymore
+		VulkanBase::waitForFrame();
+		profiler->collect(blitPass, currentFrame);
+
+		VkSemaphore computeComplete = VK_NULL_HANDLE;
+		if (dispatchCompute) {
+			// ray traces on the compute queue while the last frame is still composited and presented, already before
+			// the swap chain image is acquired; the graphics queue waits for the semaphore instead of the host
+			displayedTarget = computePipeline->getFrameIndex();
+			computeComplete = computePipeline->res.frames[displayedTarget].complete;
+			computePipeline->submitFrame();
+		}
+
 		// get next image from swap chain
-		VK_CHECK_RESULT(swapChain.acquireNextImage(semaphores.presentComplete, &currentBuffer));
+		VulkanBase::prepareFrame();
+
+		std::array<VkSemaphore, 2> waitSemaphores = { frames[currentFrame].presentComplete, computeComplete };
+		std::array<VkPipelineStageFlags, 2> waitStages = { submitPipelineStages, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT };
 
-		// command buffer to be sumitted to the queue
-		submitInfo.commandBufferCount = 1;
-		submitInfo.pCommandBuffers = &drawCmdBuffers[currentBuffer];
+		// command buffer to be sumitted to the queue, between the timestamps of the profiler
+		std::array<VkCommandBuffer, 3> commandBuffers = {
+			profiler->begin(blitPass, currentFrame),
+			drawCmdBuffers[displayedTarget * swapChain.imageCount + currentBuffer],
+			profiler->end(blitPass, currentFrame)
+		};
+		submitInfo.waitSemaphoreCount = dispatchCompute ? 2 : 1;
+		submitInfo.pWaitSemaphores = waitSemaphores.data();
+		submitInfo.pWaitDstStageMask = waitStages.data();
+		submitInfo.commandBufferCount = uint32_t(commandBuffers.size());
+		submitInfo.pCommandBuffers = commandBuffers.data();
 		VK_CHECK_RESULT(vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE));
 
 		VulkanBase::submitFrame();
-
-		// submit compute commands, the fence ensures that the compute command buffer has finished executing before it can be used again
-		vkWaitForFences(device, 1, &computePipeline->res.fence, VK_TRUE, UINT64_MAX);
-		vkResetFences(device, 1, &computePipeline->res.fence);
-
-		VkSubmitInfo computeSubmitInfo = vkTools::initializers::submitInfo();
-		computeSubmitInfo.commandBufferCount = 1;
-		computeSubmitInfo.pCommandBuffers = &computePipeline->res.commandBuffer;
-
-		VK_CHECK_RESULT(vkQueueSubmit(computePipeline->res.queue, 1, &computeSubmitInfo, computePipeline->res.fence));
 	}
 
 	virtual void render(double tDelta) {
 		if (!prepared)
 			return;
-		draw();
-		if (!paused) {
+		computePipeline->updateStorageBufferUpload();
+		computePipeline->updateBrickResidency();
+		computePipeline->updateLod(tDelta);
+		if (!paused && camera.updated) {
+			camera.updated = false;
 			computePipeline->updateUniformBuffers(camera.matrices.view, camera.position);
 		}
+		bool dispatchCompute = computePipeline->prepareFrame();
+		if (renderOnDemand && !dispatchCompute && !viewUpdated) {
+			// the image has converged and nothing else changed, wait for input; the upload is polled meanwhile
+			frameSkipped = true;
+			idleTimeout = computePipeline->backgroundWorkPending() ? 0.005 : -1.0;
+			return;
+		}
+		viewUpdated = false;
+		draw(dispatchCompute);
+	}
+
+	virtual void keyPressed(int key) {
+		if (!prepared) {
+			return;
+		}
+		if (key == GLFW_KEY_T) {
+			computePipeline->toggleTraversal();
+		} else if (key == GLFW_KEY_L) {
+			computePipeline->toggleAutoLod();
+		} else if (key == GLFW_KEY_R) {
+			computePipeline->toggleProgressive();
+		} else if (key == GLFW_KEY_EQUAL || key == GLFW_KEY_MINUS) {
+			// coarser with +, finer with -
+			computePipeline->setPixelError(computePipeline->getPixelError() * (key == GLFW_KEY_EQUAL ? 1.25f : 0.8f));
+			std::cout << "Pixel error: " << computePipeline->getPixelError() << std::endl;
+		}
 	}
 
 	virtual void viewChanged() {
@@ -328,8 +425,97 @@ public:
 	}
 };
 
-int main() {
-	VulkanApplication* vulkanApplication = new VulkanApplication("./../data/ct/kidney_128x128x128_RGB.txt");
+int main(int argc, char* argv[]) {
+	std::string path = "./../data/ct/kidney_128x128x128_RGB.txt";
+	if (argc >= 2) {
+		// one-shot conversion of a legacy text volume: --convert input.txt output.vvol
+		if (std::string(argv[1]) == "--convert") {
+			if (argc < 4) {
+				std::cout << "Usage: " << argv[0] << " --convert input.txt output" << datastructure::VOLUME_FILE_EXTENSION << std::endl;
+				return 1;
+			}
+			return datastructure::convertTxtToVolumeFile(argv[2], argv[3]) ? 0 : 1;
+		}
+		// out-of-core octree build of a volume that does not fit into memory: --build-octree input.vvol [memory budget in MB] [--threads n]
+		// the result is written as the octree cache of the volume and loaded on the next start
+		if (std::string(argv[1]) == "--build-octree") {
+			if (argc < 3) {
+				std::cout << "Usage: " << argv[0] << " --build-octree input" << datastructure::VOLUME_FILE_EXTENSION << " [memory budget in MB] [--threads n]" << std::endl;
+				return 1;
+			}
+			uint64_t memoryBudget = datastructure::DEFAULT_STREAM_MEMORY_BUDGET;
+			uint32_t numThreads = 0;
+			for (int i = 3; i < argc; i++) {
+				if (std::string(argv[i]) == "--threads" && i + 1 < argc) {
+					numThreads = uint32_t(std::stoul(argv[++i]));
+				} else {
+					memoryBudget = std::stoull(argv[i]) << 20;
+				}
+			}
+			std::string volumePath = argv[2];
+			return datastructure::buildOctreeOutOfCore(volumePath, volumePath + datastructure::OCTREE_CACHE_EXTENSION, OCTREE_POSITION, OCTREE_VOXEL_FREQ, memoryBudget, numThreads) ? 0 : 1;
+		}
+	}
+
+	// renderer options: [data set] [--compact] [--dag [tolerance]] [--bricks] [--brick-pool MB] [--node-segment MB] [--pixel-error px] [--target-ms ms]
+	// [--samples n] [--continuous] [--sweep-workgroups] [--threads n]
+	bool compactNodeEncoding = false;
+	bool useOctreeDag = false;
+	uint32_t dagColorTolerance = 0;
+	bool useBricks = false;
+	VkDeviceSize brickPoolSize = 256 * 1024 * 1024;
+	VkDeviceSize nodeSegmentSize = 0;
+	float pixelError = 1.0f;
+	float targetFrameTime = 0.0f;
+	uint32_t maxSamples = 16;
+	bool continuousRendering = false;
+	bool sweepWorkgroupSizes = false;
+	uint32_t octreeBuildThreads = 0;
+	for (int i = 1; i < argc; i++) {
+		if (std::string(argv[i]) == "--compact") {
+			compactNodeEncoding = true;
+		} else if (std::string(argv[i]) == "--bricks") {
+			useBricks = true;
+		} else if (std::string(argv[i]) == "--brick-pool" && i + 1 < argc) {
+			useBricks = true;
+			brickPoolSize = VkDeviceSize(std::stoull(argv[++i])) << 20;
+		} else if (std::string(argv[i]) == "--node-segment" && i + 1 < argc) {
+			nodeSegmentSize = VkDeviceSize(std::stoull(argv[++i])) << 20;
+		} else if (std::string(argv[i]) == "--pixel-error" && i + 1 < argc) {
+			pixelError = std::stof(argv[++i]);
+		} else if (std::string(argv[i]) == "--target-ms" && i + 1 < argc) {
+			targetFrameTime = std::stof(argv[++i]);
+		} else if (std::string(argv[i]) == "--samples" && i + 1 < argc) {
+			maxSamples = uint32_t(std::stoul(argv[++i]));
+		} else if (std::string(argv[i]) == "--continuous") {
+			continuousRendering = true;
+		} else if (std::string(argv[i]) == "--sweep-workgroups") {
+			sweepWorkgroupSizes = true;
+		} else if (std::string(argv[i]) == "--threads" && i + 1 < argc) {
+			octreeBuildThreads = uint32_t(std::stoul(argv[++i]));
+		} else if (std::string(argv[i]) == "--dag") {
+			useOctreeDag = true;
+			if (i + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[i + 1][0]))) {
+				dagColorTolerance = uint32_t(std::stoul(argv[++i]));
+			}
+		} else {
+			path = argv[i];
+		}
+	}
+
+	VulkanApplication* vulkanApplication = new VulkanApplication(path);
+	vulkanApplication->compactNodeEncoding = compactNodeEncoding;
+	vulkanApplication->useOctreeDag = useOctreeDag;
+	vulkanApplication->dagColorTolerance = dagColorTolerance;
+	vulkanApplication->useBricks = useBricks;
+	vulkanApplication->brickPoolSize = brickPoolSize;
+	vulkanApplication->nodeSegmentSize = nodeSegmentSize;
+	vulkanApplication->pixelError = pixelError;
+	vulkanApplication->targetFrameTime = targetFrameTime;
+	vulkanApplication->maxSamples = maxSamples;
+	vulkanApplication->continuousRendering = continuousRendering;
+	vulkanApplication->sweepWorkgroupSizes = sweepWorkgroupSizes;
+	vulkanApplication->octreeBuildThreads = octreeBuildThreads;
 	vulkanApplication->initWindow();
 	vulkanApplication->initSwapchain();
 	vulkanApplication->prepare();
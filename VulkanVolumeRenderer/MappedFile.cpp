@@ -0,0 +1,93 @@
+#include "MappedFile.hpp"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace util {
+
+#if defined(_WIN32)
+	bool MappedFile::open(const std::string& path) {
+		close();
+
+		fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (fileHandle == INVALID_HANDLE_VALUE) {
+			return false;
+		}
+
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0) {
+			close();
+			return false;
+		}
+
+		mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mappingHandle == NULL) {
+			close();
+			return false;
+		}
+
+		mappedData = static_cast<const uint8_t*>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0));
+		if (mappedData == nullptr) {
+			close();
+			return false;
+		}
+		mappedSize = uint64_t(fileSize.QuadPart);
+		return true;
+	}
+
+	void MappedFile::close() {
+		if (mappedData != nullptr) {
+			UnmapViewOfFile(mappedData);
+			mappedData = nullptr;
+		}
+		if (mappingHandle != NULL) {
+			CloseHandle(mappingHandle);
+			mappingHandle = NULL;
+		}
+		if (fileHandle != INVALID_HANDLE_VALUE) {
+			CloseHandle(fileHandle);
+			fileHandle = INVALID_HANDLE_VALUE;
+		}
+		mappedSize = 0;
+	}
+#else
+	bool MappedFile::open(const std::string& path) {
+		close();
+
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) {
+			return false;
+		}
+
+		struct stat fileStat;
+		if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0) {
+			::close(fd);
+			return false;
+		}
+
+		void* mapping = mmap(nullptr, size_t(fileStat.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+		// the mapping keeps its own reference to the file
+		::close(fd);
+		if (mapping == MAP_FAILED) {
+			return false;
+		}
+		madvise(mapping, size_t(fileStat.st_size), MADV_SEQUENTIAL);
+
+		mappedData = static_cast<const uint8_t*>(mapping);
+		mappedSize = uint64_t(fileStat.st_size);
+		return true;
+	}
+
+	void MappedFile::close() {
+		if (mappedData != nullptr) {
+			munmap(const_cast<uint8_t*>(mappedData), size_t(mappedSize));
+			mappedData = nullptr;
+		}
+		mappedSize = 0;
+	}
+#endif
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+namespace util {
+	// read-only memory mapping of a whole file, the mapping is released on close() or destruction
+	class MappedFile {
+	private:
+		const uint8_t* mappedData = nullptr;
+		uint64_t mappedSize = 0;
+#if defined(_WIN32)
+		HANDLE fileHandle = INVALID_HANDLE_VALUE;
+		HANDLE mappingHandle = NULL;
+#endif
+
+	public:
+		MappedFile() {
+		}
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		~MappedFile() {
+			close();
+		}
+
+		// maps the file at path, returns false if it cannot be opened or is empty
+		bool open(const std::string& path);
+
+		void close();
+
+		bool isOpen() const {
+			return mappedData != nullptr;
+		}
+
+		const uint8_t* data() const {
+			return mappedData;
+		}
+
+		uint64_t size() const {
+			return mappedSize;
+		}
+	};
+}
@@ -0,0 +1,205 @@
+#include "NodeSegments.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+namespace datastructure {
+
+	namespace {
+		// sibling groups are stored at 1 + 8k
+		uint32_t groupOf(uint32_t firstChild) {
+			return (firstChild - 1) / 8;
+		}
+
+		// visits the groups below a group on the next level, every group once per stamp
+		class GroupWalker {
+		private:
+			const Node* nodes;
+			uint32_t pointerLevels;
+			std::vector<uint32_t> stamps;
+			uint32_t stamp = 0;
+
+		public:
+			// local group index of every group within the segment that is laid out, valid for the current stamp
+			std::vector<uint32_t> localGroups;
+
+			GroupWalker(const Node* nodes, uint64_t numNodes, uint32_t pointerLevels) {
+				this->nodes = nodes;
+				this->pointerLevels = pointerLevels;
+				stamps.assign(size_t(numNodes / 8 + 1), UINT32_MAX);
+				localGroups.resize(stamps.size());
+			}
+
+			void nextStamp() {
+				stamp++;
+			}
+
+			// returns true if the group has not been visited with the current stamp yet
+			bool visit(uint32_t group) {
+				if (stamps[group] == stamp) {
+					return false;
+				}
+				stamps[group] = stamp;
+				return true;
+			}
+
+			// nodes reachable from the group on level, groups shared within the subtree are counted once
+			uint64_t countNodes(uint32_t group, uint32_t level) {
+				nextStamp();
+				visit(group);
+				std::vector<uint32_t> frontier = { group };
+				uint64_t count = 0;
+				while (!frontier.empty()) {
+					count += 8 * uint64_t(frontier.size());
+					if (level >= pointerLevels) {
+						break;
+					}
+					std::vector<uint32_t> next;
+					for (uint32_t parent : frontier) {
+						for (uint32_t i = 0; i < 8; i++) {
+							uint32_t firstChild = nodes[1 + 8 * uint64_t(parent) + i].firstChild;
+							if (firstChild != 0 && visit(groupOf(firstChild))) {
+								next.push_back(groupOf(firstChild));
+							}
+						}
+					}
+					frontier.swap(next);
+					level++;
+				}
+				return count;
+			}
+		};
+	}
+
+	bool splitNodeSegments(const Node* nodes, uint64_t numNodes, uint32_t pointerLevels, uint64_t maxSegmentNodes, uint32_t maxSegments, NodeSegments* segments) {
+		auto tStart = std::chrono::high_resolution_clock::now();
+		maxSegmentNodes = std::min<uint64_t>(maxSegmentNodes, uint64_t(NODE_INDEX_MASK) + 1);
+
+		// the levels are contiguous, every level ends behind the last child group of the previous one
+		std::vector<uint64_t> levelStarts = { 0, 1 };
+		while (levelStarts.size() - 2 < pointerLevels) {
+			uint64_t levelEnd = 0;
+			for (uint64_t i = levelStarts[levelStarts.size() - 2]; i < levelStarts.back(); i++) {
+				if (nodes[i].firstChild != 0) {
+					levelEnd = std::max<uint64_t>(levelEnd, uint64_t(nodes[i].firstChild) + 8);
+				}
+			}
+			if (levelEnd == 0) {
+				break;
+			}
+			levelStarts.push_back(levelEnd);
+		}
+		uint32_t numLevels = uint32_t(levelStarts.size() - 1);
+
+		// the subtrees below the split level are packed into the segments in order, behind a copy of the levels
+		// above; deeper splits give smaller subtrees at the cost of a larger copy
+		GroupWalker walker(nodes, numNodes, pointerLevels);
+		uint32_t splitLevel = 1;
+		std::vector<uint32_t> subtreeSegments;
+		uint32_t numSegments = 0;
+		for (; splitLevel + 1 < numLevels; splitLevel++) {
+			uint64_t topNodes = levelStarts[splitLevel + 1];
+			if (topNodes >= maxSegmentNodes) {
+				break;
+			}
+			subtreeSegments.assign(size_t(topNodes - levelStarts[splitLevel]), 0);
+			numSegments = 1;
+			uint64_t segmentNodes = topNodes;
+			bool fits = true;
+			for (uint64_t i = levelStarts[splitLevel]; i < topNodes && fits; i++) {
+				if (nodes[i].firstChild == 0) {
+					continue;
+				}
+				uint64_t subtreeNodes = walker.countNodes(groupOf(nodes[i].firstChild), splitLevel + 1);
+				fits = topNodes + subtreeNodes <= maxSegmentNodes;
+				if (segmentNodes + subtreeNodes > maxSegmentNodes) {
+					numSegments++;
+					segmentNodes = topNodes;
+				}
+				segmentNodes += subtreeNodes;
+				subtreeSegments[size_t(i - levelStarts[splitLevel])] = numSegments - 1;
+			}
+			if (fits && numSegments <= maxSegments) {
+				break;
+			}
+		}
+		if (splitLevel + 1 >= numLevels || levelStarts[splitLevel + 1] >= maxSegmentNodes) {
+			std::cout << "The subtrees of the octree do not fit into " << maxSegments << " segments of " << maxSegmentNodes << " nodes" << std::endl;
+			return false;
+		}
+
+		// the child groups of the subtree roots are numbered first in every segment, so that the roots of the other
+		// segments can point to them
+		uint64_t topNodes = levelStarts[splitLevel + 1];
+		std::vector<uint32_t> subtreeHandles(subtreeSegments.size(), 0);
+		std::vector<std::vector<uint32_t>> subtreeGroups(numSegments);
+		for (uint32_t segment = 0; segment < numSegments; segment++) {
+			walker.nextStamp();
+			uint32_t nextGroup = uint32_t((topNodes - 1) / 8);
+			for (uint64_t i = levelStarts[splitLevel]; i < topNodes; i++) {
+				uint32_t firstChild = nodes[i].firstChild;
+				if (firstChild == 0 || subtreeSegments[size_t(i - levelStarts[splitLevel])] != segment) {
+					continue;
+				}
+				uint32_t group = groupOf(firstChild);
+				if (walker.visit(group)) {
+					walker.localGroups[group] = nextGroup++;
+					subtreeGroups[segment].push_back(group);
+				}
+				subtreeHandles[size_t(i - levelStarts[splitLevel])] = nodeHandle(segment, 1 + 8 * walker.localGroups[group]);
+			}
+		}
+
+		segments->splitLevel = splitLevel;
+		segments->segments.assign(numSegments, std::vector<Node>());
+		uint64_t totalNodes = 0;
+		for (uint32_t segment = 0; segment < numSegments; segment++) {
+			// the levels down to the split keep their indices, so only the segment is added to their pointers
+			std::vector<Node>& out = segments->segments[segment];
+			out.assign(nodes, nodes + topNodes);
+			for (uint64_t i = 1; i < topNodes; i++) {
+				if (i >= levelStarts[splitLevel]) {
+					out[size_t(i)].firstChild = subtreeHandles[size_t(i - levelStarts[splitLevel])];
+				} else if (out[size_t(i)].firstChild != 0) {
+					out[size_t(i)].firstChild = nodeHandle(segment, out[size_t(i)].firstChild);
+				}
+			}
+			if (out[0].firstChild != 0) {
+				out[0].firstChild = nodeHandle(segment, out[0].firstChild);
+			}
+
+			// the subtrees are appended level by level like the levels of a tree
+			walker.nextStamp();
+			std::vector<uint32_t> frontier = subtreeGroups[segment];
+			for (uint32_t level = splitLevel + 1; !frontier.empty(); level++) {
+				size_t levelStart = out.size();
+				for (uint32_t group : frontier) {
+					out.insert(out.end(), nodes + 1 + 8 * uint64_t(group), nodes + 1 + 8 * uint64_t(group) + 8);
+				}
+				std::vector<uint32_t> next;
+				if (level < pointerLevels) {
+					uint32_t nextGroup = uint32_t((out.size() - 1) / 8);
+					for (size_t i = levelStart; i < out.size(); i++) {
+						if (out[i].firstChild == 0) {
+							continue;
+						}
+						uint32_t group = groupOf(out[i].firstChild);
+						if (walker.visit(group)) {
+							walker.localGroups[group] = nextGroup++;
+							next.push_back(group);
+						}
+						out[i].firstChild = nodeHandle(segment, 1 + 8 * walker.localGroups[group]);
+					}
+				}
+				frontier.swap(next);
+			}
+			totalNodes += out.size();
+		}
+
+		auto tEnd = std::chrono::high_resolution_clock::now();
+		std::cout << "Node segments: " << numSegments << " segments split at level " << splitLevel << ", " << totalNodes << " of " << numNodes
+			<< " nodes including the copies, " << std::chrono::duration<double, std::milli>(tEnd - tStart).count() << " ms" << std::endl;
+		return true;
+	}
+}
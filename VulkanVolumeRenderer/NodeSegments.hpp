@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "Octree.hpp"
+
+namespace datastructure {
+	// child pointers of a segmented tree are node handles: the segment in the top bits and the index within the
+	// segment below, has to match NODE_SEGMENT_SHIFT in raytracing.comp; a tree in a single segment uses plain indices
+	const uint32_t NODE_SEGMENT_SHIFT = 29;
+	const uint32_t NODE_INDEX_MASK = (uint32_t(1) << NODE_SEGMENT_SHIFT) - 1;
+
+	inline uint32_t nodeHandle(uint32_t segment, uint32_t index) {
+		return (segment << NODE_SEGMENT_SHIFT) | index;
+	}
+
+	// a tree split at splitLevel into segments that each hold a copy of the levels down to splitLevel and a run of
+	// whole subtrees below it. Every segment is laid out like a tree of its own (root at 0, levels one after
+	// another, sibling groups at 1 + 8k), its child pointers are handles into the same segment; only the nodes on
+	// splitLevel whose subtree was placed in another segment point there.
+	struct NodeSegments {
+		std::vector<std::vector<Node>> segments;
+		uint32_t splitLevel = 0;
+	};
+
+	// splits a finished tree or DAG (root first, levels one after another) into at most maxSegments segments of at
+	// most maxSegmentNodes nodes, choosing the shallowest split level whose subtrees fit. Groups shared by subtrees
+	// of different segments are copied into each of them. firstChild is only a child pointer on the levels above
+	// pointerLevels, e.g. the brick level of a BrickTree. Returns false if the subtrees cannot be distributed.
+	bool splitNodeSegments(const Node* nodes, uint64_t numNodes, uint32_t pointerLevels, uint64_t maxSegmentNodes, uint32_t maxSegments, NodeSegments* segments);
+}
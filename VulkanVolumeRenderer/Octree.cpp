@@ -1,119 +1,327 @@
 #include "Octree.hpp"
 
+#include <algorithm>
+#include <chrono>
+
+#include "NodeSegments.hpp"
+#include "Parallel.hpp"
+
 using namespace datastructure;
 
 namespace datastructure {
 
-	// public
-	std::vector<Node> Octree::create(std::vector<uint32_t> voxelData) {
-		int power = int(std::log(voxelData.size()) / std::log(8));
-		uint32_t numNodes = 0;
-		for (int i = power; i >= 0; i--) {
-			numNodes += uint32_t(pow(8, i));
-		}
-
-		std::vector<Node> nodes;
-		nodes.resize(numNodes);
-
-		// init nodes and linkages, if leaf then children point to root (index 0)
-		int powerIter = 0;
-		uint32_t skipSection = 0;
-		uint32_t skipSectionNext = 1;
-		while (powerIter != power) {
-			for (int i = 0; i < uint32_t(pow(8, powerIter)); i++) {
-				Node node;
-				node.firstChild = skipSectionNext + i * 8;
-				nodes[skipSection + i] = node;
-			}
-			skipSection = skipSectionNext;
-			skipSectionNext += uint32_t(pow(8, powerIter + 1));
-			powerIter++;
+	namespace {
+		// extracts every third bit of a morton code, i.e. the coordinate of one axis
+		uint32_t compactMortonBits(uint64_t code) {
+			code &= 0x1249249249249249ull;
+			code = (code ^ (code >> 2)) & 0x10c30c30c30c30c3ull;
+			code = (code ^ (code >> 4)) & 0x100f00f00f00f00full;
+			code = (code ^ (code >> 8)) & 0x1f0000ff0000ffull;
+			code = (code ^ (code >> 16)) & 0x1f00000000ffffull;
+			code = (code ^ (code >> 32)) & 0x1fffffull;
+			return uint32_t(code);
 		}
 
-		// fill leaves with voxel information
-		uint32_t voxelsPerSide = uint32_t(std::pow(2, power));
-		uint32_t startIdx = nodes.size() - voxelData.size();
-		uint32_t currentIdx = 0;
-		for (int i = startIdx; i < nodes.size(); i += 8) {
-			std::vector<uint32_t> indices = nextVoxelIdxBlock(currentIdx, voxelsPerSide);
-
-			for (int j = 0; j < 8; j++) {
-				nodes[i + j].color = voxelData[indices[j]];
+		// channel wise mean of 8 sibling colors, rounded down like the averaging of the shader side uvec4s
+		uint32_t meanColor(const Node* children) {
+			uint32_t r = 0, g = 0, b = 0, a = 0;
+			for (int i = 0; i < 8; i++) {
+				uint32_t color = children[i].color;
+				r += color >> 24;
+				g += (color >> 16) & 0xFF;
+				b += (color >> 8) & 0xFF;
+				a += color & 0xFF;
 			}
-			currentIdx = nextNodeStartIdx(currentIdx, voxelsPerSide);
+			return ((r / 8) << 24) | ((g / 8) << 16) | ((b / 8) << 8) | (a / 8);
 		}
+	}
 
-		// rearrange top layers: creates new node vector and fills it up with nodes from nodes vector in the correct order, then copy them back into the vector
-		uint32_t processedNodes = uint32_t(std::pow(8, power));;
-		power--;
+	SubtreeBuilder::SubtreeBuilder(uint32_t rootLevel, uint32_t depth) {
+		this->rootLevel = rootLevel;
+		levels.resize(depth + 1);
+		std::fill_n(pendingOccupied, MAX_OCTREE_DEPTH + 1, 0);
+		root.color = 0;
+		root.firstChild = NO_CHILDREN;
+		root.childMasks = 0;
+	}
 
-		while (power != 0) {
-			voxelsPerSide = uint32_t(std::pow(2, power));
-			uint32_t startIdx = nodes.size() - processedNodes - uint32_t(std::pow(8, power));
-			uint32_t endIdx = nodes.size() - processedNodes;
-			std::vector<Node> tmp(endIdx - startIdx);
-			uint32_t currentIdx = 0;
-			for (int i = 0; i < endIdx - startIdx; i += 8) {
-				std::vector<uint32_t> indices = nextVoxelIdxBlock(startIdx + currentIdx, voxelsPerSide);
+	void SubtreeBuilder::push(uint32_t level, uint64_t code, Node node, bool occupied) {
+		while (level != rootLevel) {
+			uint32_t slot = uint32_t(code & 7);
+			pending[level][slot] = node;
+			pendingOccupied[level] |= uint8_t(occupied) << slot;
+			if (slot != 7) {
+				return;
+			}
 
-				for (int j = 0; j < 8; j++) {
-					tmp[i + j] = nodes[indices[j]];
-				}
-				currentIdx = nextNodeStartIdx(currentIdx, voxelsPerSide);
+			// the sibling group is complete: the parent averages it and only keeps it if anything is visible
+			occupied = pendingOccupied[level] != 0;
+			node.color = meanColor(pending[level]);
+			node.firstChild = NO_CHILDREN;
+			node.childMasks = 0;
+			if (occupied) {
+				node.childMasks = childMasks(pending[level]);
+				node.firstChild = uint32_t(levels[level].size() / 8);
+				levels[level].insert(levels[level].end(), pending[level], pending[level] + 8);
 			}
+			pendingOccupied[level] = 0;
+			code >>= 3;
+			level--;
+		}
+		root = node;
+		rootOccupied = occupied;
+	}
+
+	SubtreeLinker::SubtreeLinker(uint32_t splitLevel, uint32_t depth, uint32_t numSubtrees) {
+		this->splitLevel = splitLevel;
+		this->depth = depth;
+		this->numSubtrees = numSubtrees;
+		numGroups.assign(depth + 2, 0);
+		groupBase.assign(depth + 2, 0);
+		subtreeGroupOffsets.assign(uint64_t(numSubtrees) * (depth + 2), 0);
+	}
 
-			for (int i = startIdx; i < endIdx; i++) {
-				nodes[i] = tmp[i - startIdx];
+	void SubtreeLinker::computeSubtreeOffsets() {
+		for (uint32_t level = splitLevel + 1; level <= depth; level++) {
+			for (uint32_t subtree = 0; subtree < numSubtrees; subtree++) {
+				uint64_t& offset = subtreeGroupOffsets[uint64_t(subtree) * (depth + 2) + level];
+				uint64_t groups = offset;
+				offset = numGroups[level];
+				numGroups[level] += groups;
 			}
+		}
+	}
+
+	Node SubtreeLinker::subtreeRoot(uint32_t subtree, Node root) const {
+		if (root.firstChild != NO_CHILDREN) {
+			root.firstChild += uint32_t(subtreeGroupOffsets[uint64_t(subtree) * (depth + 2) + splitLevel + 1]);
+		}
+		return root;
+	}
 
-			processedNodes += uint32_t(std::pow(8, power));
-			currentIdx = nodes.size() - processedNodes;
-			power--;
+	uint64_t SubtreeLinker::computeGroupBases() {
+		for (uint32_t level = 1; level <= depth; level++) {
+			groupBase[level + 1] = groupBase[level] + numGroups[level];
 		}
+		return 1 + 8 * groupBase[depth + 1];
+	}
 
-		// set values of higher nodes
+	Node SubtreeLinker::link(Node node, uint32_t level, uint32_t subtree) const {
+		if (node.firstChild == NO_CHILDREN) {
+			node.firstChild = 0;
+			return node;
+		}
+		uint64_t groupOffset = level > splitLevel ? subtreeGroupOffsets[uint64_t(subtree) * (depth + 2) + level + 1] : 0;
+		node.firstChild = uint32_t(1 + 8 * (groupBase[level + 1] + groupOffset + node.firstChild));
+		return node;
+	}
 
-		for (int i = nodes.size() - voxelData.size() - 1; i >= 0; i--) {
-			glm::uvec4 meanVal = glm::uvec4(0.0);
-			for (int j = 0; j < 8; j++) {
-				meanVal += intToVec4(nodes[nodes[i].firstChild + j].color);
-			}
-			meanVal /= 8;
-			nodes[i].color = vec4ToInt(meanVal);
+	OctreeLayout::OctreeLayout(glm::uvec3 dims, glm::vec3 spacing, glm::vec3 pos, float voxelFreq) {
+		this->voxelFreq = voxelFreq;
+		this->dims = dims;
+
+		// the tree covers the smallest power of two cube around the volume
+		uint32_t maxDim = std::max(dims.x, std::max(dims.y, dims.z));
+		depth = 0;
+		while ((uint32_t(1) << depth) < maxDim) {
+			depth++;
+		}
+		// deeper trees are rejected by the builders
+		numVoxelsSide = int32_t(1) << depth;
+
+		// anisotropic voxels keep their proportions, the finest axis is voxelFreq wide
+		if (spacing.x <= 0.0f || spacing.y <= 0.0f || spacing.z <= 0.0f) {
+			spacing = glm::vec3(1.0f);
 		}
+		voxelSize = voxelFreq * spacing / std::min(spacing.x, std::min(spacing.y, spacing.z));
 
-		return nodes;
+		// pos is the center of the volume, the root node additionally covers the padding on the far sides
+		this->pos = pos + (glm::vec3(numVoxelsSide) - glm::vec3(dims)) * voxelSize * 0.5f;
 	}
 
-	std::vector<uint32_t> Octree::nextVoxelIdxBlock(uint32_t startVoxel, uint32_t N) {
-		std::vector<uint32_t> voxelIndices(8);
-		uint32_t Nsquare = N*N;
-		voxelIndices[0] = startVoxel;
-		voxelIndices[1] = startVoxel + 1;
-		voxelIndices[2] = startVoxel + N;
-		voxelIndices[3] = startVoxel + N + 1;
-		voxelIndices[4] = startVoxel + Nsquare;
-		voxelIndices[5] = startVoxel + Nsquare + 1;
-		voxelIndices[6] = startVoxel + Nsquare + N;
-		voxelIndices[7] = startVoxel + Nsquare + N + 1;
-		return voxelIndices;
+	void buildSubtree(const VolumeView& slab, uint32_t firstSlice, const OctreeLayout& layout, SubtreeBuilder* builder, uint64_t rootCode) {
+		// single bottom-up pass in morton order, every voxel is visited once and every node is finished
+		// as soon as its last child has been pushed
+		uint32_t depth = layout.depth;
+		glm::uvec3 dims = layout.dims;
+		uint64_t numLeaves = uint64_t(1) << (3 * (depth - builder->rootLevel));
+		uint64_t firstLeafCode = rootCode * numLeaves;
+		uint64_t endLeafCode = firstLeafCode + numLeaves;
+		Node emptyNode;
+		emptyNode.color = 0;
+		emptyNode.firstChild = NO_CHILDREN;
+		emptyNode.childMasks = 0;
+		for (uint64_t code = firstLeafCode; code < endLeafCode;) {
+			uint32_t x = compactMortonBits(code);
+			uint32_t y = compactMortonBits(code >> 1);
+			uint32_t z = compactMortonBits(code >> 2);
+
+			if (x >= dims.x || y >= dims.y || z >= dims.z) {
+				// the padding up to the next power of two is implicit: the largest aligned block starting
+				// at this voxel lies completely outside of the volume and is pushed as a single empty node
+				uint32_t skipLevels = 0;
+				while (skipLevels < depth - builder->rootLevel && (code & ((uint64_t(1) << (3 * (skipLevels + 1))) - 1)) == 0) {
+					skipLevels++;
+				}
+				builder->push(depth - skipLevels, code >> (3 * skipLevels), emptyNode, false);
+				code += uint64_t(1) << (3 * skipLevels);
+				continue;
+			}
+
+			Node leaf;
+			leaf.color = slab.voxel(x + (y + uint64_t(z - firstSlice) * dims.y) * dims.x);
+			leaf.firstChild = NO_CHILDREN;
+			leaf.childMasks = 0;
+			builder->push(depth, code, leaf, !isTransparent(leaf.color));
+			code++;
+		}
 	}
 
-	uint32_t Octree::nextNodeStartIdx(uint32_t currentIdx, uint32_t N) {
-		uint32_t nextIdx = currentIdx + 2;
-		// checks with +2 because zero based index
-		if ((currentIdx + 2) % N == 0) {
-			nextIdx += N;
-			if ((((currentIdx + 2) / N) + 1) % N == 0) {
-				nextIdx += N*N;
+	bool encodeCompactNodes(const Node* nodes, uint64_t numNodes, CompactNodes* compact, uint32_t segment) {
+		for (uint64_t i = 0; i < numNodes; i++) {
+			if (nodes[i].color != (nodes[i].color & 0xFF) * 0x01010101u) {
+				std::cout << "Node " << i << " is not grey scale, the compact encoding only stores one intensity per node" << std::endl;
+				return false;
+			}
+		}
+
+		std::vector<uint32_t> farPointers;
+		compact->numNodes = uint32_t(numNodes);
+		compact->words.resize(size_t(numNodes));
+		for (uint64_t i = 0; i < numNodes; i++) {
+			uint32_t word = (nodes[i].childMasks >> VISIBLE_CHILDREN_SHIFT) & 0xFF;
+			if (nodes[i].firstChild != 0) {
+				// children are stored behind their parent, so the distance is at least one group
+				uint64_t pointer = (uint64_t(nodes[i].firstChild & NODE_INDEX_MASK) + 7) / 8 - (i + 7) / 8;
+				if (pointer > COMPACT_MAX_POINTER || nodes[i].firstChild >> NODE_SEGMENT_SHIFT != segment) {
+					if (farPointers.size() > COMPACT_MAX_POINTER) {
+						std::cout << "The octree needs more than " << COMPACT_MAX_POINTER << " far pointers" << std::endl;
+						return false;
+					}
+					word |= COMPACT_FAR_BIT;
+					pointer = farPointers.size();
+					farPointers.push_back(nodes[i].firstChild);
+				}
+				word |= uint32_t(pointer) << COMPACT_POINTER_SHIFT;
 			}
+			compact->words[size_t(i)] = word;
 		}
-		return nextIdx;
+
+		if (compact->words.size() + farPointers.size() + (numNodes + 3) / 4 > UINT32_MAX) {
+			std::cout << "The compact encoding of " << numNodes << " nodes exceeds 32 bit word offsets" << std::endl;
+			return false;
+		}
+		compact->farPointerOffset = uint32_t(compact->words.size());
+		compact->words.insert(compact->words.end(), farPointers.begin(), farPointers.end());
+		compact->attributeOffset = uint32_t(compact->words.size());
+		compact->words.resize(compact->words.size() + size_t((numNodes + 3) / 4), 0);
+		uint32_t* attributes = compact->words.data() + compact->attributeOffset;
+		for (uint64_t i = 0; i < numNodes; i++) {
+			attributes[i / 4] |= (nodes[i].color & 0xFF) << (8 * (i % 4));
+		}
+
+		std::cout << "Compact node encoding: " << compact->words.size() * sizeof(uint32_t) / 1000000.0 << " MB instead of "
+			<< numNodes * sizeof(Node) / 1000000.0 << " MB, " << farPointers.size() << " far pointers" << std::endl;
+		return true;
 	}
 
 	// private
-	void Octree::removeEmptyNodes() {
-		// removes 1/4 of the volume to give a more interesting image
-		//nodes[8].color = vec4ToInt(glm::vec4(0, 0, 0, 0));
+	bool Octree::create(const VolumeView& volume, uint32_t numThreads, NodeListener* listener) {
+		if (depth > MAX_OCTREE_DEPTH) {
+			std::cout << "The volume exceeds the maximum of " << (1 << MAX_OCTREE_DEPTH) << " voxels per side!" << std::endl;
+			return false;
+		}
+
+		// the subtrees below the split level are disjoint and are built as independent tasks, there are
+		// at least 8 per thread so that threads finishing early can balance the load
+		uint32_t splitLevel = 0;
+		while (splitLevel < depth && (uint64_t(1) << (3 * splitLevel)) < uint64_t(numThreads) * 8) {
+			splitLevel++;
+		}
+		if (numThreads == 1) {
+			splitLevel = 0;
+		}
+
+		uint32_t numSubtrees = uint32_t(1) << (3 * splitLevel);
+		std::vector<SubtreeBuilder> subtrees(numSubtrees, SubtreeBuilder(splitLevel, depth));
+		util::parallelFor(numSubtrees, numThreads, [&](uint32_t subtree) {
+			buildSubtree(volume, 0, *this, &subtrees[subtree], subtree);
+		});
+
+		SubtreeLinker linker(splitLevel, depth, numSubtrees);
+		for (uint32_t subtree = 0; subtree < numSubtrees; subtree++) {
+			for (uint32_t level = splitLevel + 1; level <= depth; level++) {
+				linker.setSubtreeGroups(subtree, level, subtrees[subtree].levels[level].size() / 8);
+			}
+		}
+		linker.computeSubtreeOffsets();
+
+		// the few levels above the split are built from the subtree roots on the calling thread
+		SubtreeBuilder top(0, depth);
+		for (uint32_t subtree = 0; subtree < numSubtrees; subtree++) {
+			top.push(splitLevel, subtree, linker.subtreeRoot(subtree, subtrees[subtree].root), subtrees[subtree].rootOccupied);
+		}
+		for (uint32_t level = 1; level <= splitLevel; level++) {
+			linker.setTopGroups(level, top.levels[level].size() / 8);
+		}
+		uint64_t numNodes = linker.computeGroupBases();
+		if (numNodes > UINT32_MAX) {
+			std::cout << "The octree has " << numNodes << " nodes, node indices are limited to 32 bit!" << std::endl;
+			return false;
+		}
+
+		// the array is reserved once, so the pointer seen by the listener stays valid
+		nodes.reserve(size_t(numNodes));
+		if (listener != nullptr) {
+			listener->nodesAllocated(numNodes);
+		}
+		levelOffsets.assign(depth + 2, 0);
+		nodes.push_back(linker.link(top.root, 0, 0));
+		for (uint32_t level = 1; level <= splitLevel; level++) {
+			levelOffsets[level] = uint32_t(nodes.size());
+			for (const Node& node : top.levels[level]) {
+				nodes.push_back(linker.link(node, level, 0));
+			}
+		}
+		// the levels above the split are final as soon as the group bases are known, they are passed on before
+		// the subtree levels are copied, so that their upload overlaps the rest of the assembly
+		if (listener != nullptr) {
+			listener->nodesFinished(nodes.data(), nodes.size());
+		}
+		for (uint32_t level = splitLevel + 1; level <= depth; level++) {
+			levelOffsets[level] = uint32_t(nodes.size());
+			for (uint32_t subtree = 0; subtree < numSubtrees; subtree++) {
+				for (const Node& node : subtrees[subtree].levels[level]) {
+					nodes.push_back(linker.link(node, level, subtree));
+				}
+				// release the builder level right away to keep the peak memory close to the final tree
+				std::vector<Node>().swap(subtrees[subtree].levels[level]);
+				if (listener != nullptr) {
+					listener->nodesFinished(nodes.data(), nodes.size());
+				}
+			}
+		}
+		levelOffsets[depth + 1] = uint32_t(nodes.size());
+
+		return true;
+	}
+
+	// public
+	Octree::Octree(const VolumeView& volume, glm::vec3 pos, float voxelFreq, uint32_t numThreads, NodeListener* listener) : OctreeLayout(volume.dims, volume.spacing, pos, voxelFreq) {
+		if (numThreads == 0) {
+			numThreads = util::defaultThreadCount();
+		}
+
+		auto tStart = std::chrono::high_resolution_clock::now();
+		if (!create(volume, numThreads, listener)) {
+			return;
+		}
+		auto tEnd = std::chrono::high_resolution_clock::now();
+
+		double milliseconds = std::chrono::duration<double, std::milli>(tEnd - tStart).count();
+		std::cout << "Octree built: " << dims.x << "x" << dims.y << "x" << dims.z << " voxels, " << nodes.size() << " nodes, depth " << depth << ", " << milliseconds << " ms ("
+			<< milliseconds / (volume.numVoxels() / 1000000.0) << " ms per million voxels) on " << numThreads << " threads" << std::endl;
+		std::cout << "Sparse octree: " << nodes.size() << " of " << numDenseNodes() << " dense nodes, compression ratio "
+			<< double(numDenseNodes()) / nodes.size() << ":1" << std::endl;
 	}
-}
\ No newline at end of file
+}
@@ -8,39 +8,199 @@
 #include <glm/gtc/matrix_transform.hpp>
 
 #include "DatastructureCreator.hpp"
+#include "VolumeFile.hpp"
 
 namespace datastructure {
 	struct Node {
 		uint32_t color;
 		uint32_t firstChild;
+		// summary of the 8 children so that the traversal does not have to load them, see childMasks()
+		uint32_t childMasks;
 	};
 
-	class Octree {
+	// bit i of the low byte of Node::childMasks is set if child i is visible (alpha > 0),
+	// bit i of the second byte if child i has no children
+	const uint32_t VISIBLE_CHILDREN_SHIFT = 0;
+	const uint32_t LEAF_CHILDREN_SHIFT = 8;
+
+	// deepest supported tree, 2048 voxels per side; the node count of the sparse tree has to fit into 32 bit
+	const uint32_t MAX_OCTREE_DEPTH = 11;
+
+	// identifies the output of the builder, has to be increased whenever the node layout or the tree
+	// produced for the same input changes so that cached trees are rebuilt
+	const uint32_t OCTREE_BUILDER_VERSION = 2;
+
+	// marks a node without children while a tree is being built (firstChild 0 in the finished tree)
+	const uint32_t NO_CHILDREN = UINT32_MAX;
+
+	inline bool isTransparent(uint32_t color) {
+		return (color & 0xFF) == 0;
+	}
+
+	// masks of a sibling group while the tree is built, i.e. before firstChild is linked
+	inline uint32_t childMasks(const Node* children) {
+		uint32_t masks = 0;
+		for (uint32_t i = 0; i < 8; i++) {
+			masks |= uint32_t(!isTransparent(children[i].color)) << (VISIBLE_CHILDREN_SHIFT + i);
+			masks |= uint32_t(children[i].firstChild == NO_CHILDREN) << (LEAF_CHILDREN_SHIFT + i);
+		}
+		return masks;
+	}
+
+	// builds the levels below a subtree root from nodes pushed in morton order, only subtrees
+	// containing at least one non-transparent voxel keep their children
+	class SubtreeBuilder {
 	private:
-		std::vector<Node> nodes;
+		Node pending[MAX_OCTREE_DEPTH + 1][8];
+		uint8_t pendingOccupied[MAX_OCTREE_DEPTH + 1];
+
+	public:
+		uint32_t rootLevel;
+		// groups of 8 siblings per level in morton order, firstChild holds the index
+		// of the child group within the next level or NO_CHILDREN
+		std::vector<std::vector<Node>> levels;
+		Node root;
+		bool rootOccupied = false;
 
-		std::vector<Node> create(std::vector<uint32_t> voxelData);
+		SubtreeBuilder(uint32_t rootLevel, uint32_t depth);
 
-		std::vector<uint32_t> nextVoxelIdxBlock(uint32_t startVoxel, uint32_t N);
+		// adds the node with the given morton code on level, completed sibling groups are passed up the tree
+		void push(uint32_t level, uint64_t code, Node node, bool occupied);
+	};
 
-		uint32_t nextNodeStartIdx(uint32_t currentIdx, uint32_t N);
+	// index arithmetic for a tree whose levels below splitLevel are the concatenation of independently built
+	// subtrees: levels are stored breadth first and consist of sibling groups, so the global index of a child
+	// group follows from the group counts of the levels above and of the preceding subtrees on the same level
+	class SubtreeLinker {
+	private:
+		uint32_t splitLevel;
+		uint32_t depth;
+		uint32_t numSubtrees;
+		std::vector<uint64_t> numGroups;
+		std::vector<uint64_t> groupBase;
+		// group offset of every subtree on every level, indexed by subtree * (depth + 2) + level
+		std::vector<uint64_t> subtreeGroupOffsets;
 
 	public:
+		SubtreeLinker(uint32_t splitLevel, uint32_t depth, uint32_t numSubtrees);
+
+		// has to be called for every subtree and every level below the split before any other method
+		void setSubtreeGroups(uint32_t subtree, uint32_t level, uint64_t groups) {
+			subtreeGroupOffsets[uint64_t(subtree) * (depth + 2) + level] = groups;
+		}
+
+		// turns the group counts into offsets within the levels below the split
+		void computeSubtreeOffsets();
+
+		// returns the root of the subtree with its child group shifted to the numbering of the whole level
+		Node subtreeRoot(uint32_t subtree, Node root) const;
+
+		// group counts of the levels above the split, which are built from the subtree roots
+		void setTopGroups(uint32_t level, uint64_t groups) {
+			numGroups[level] = groups;
+		}
+
+		// returns the node count of the whole tree
+		uint64_t computeGroupBases();
+
+		// turns the group index of a node's children within its subtree into a global node index, nodes on
+		// levels above the split already refer to global groups, nodes without children get firstChild 0
+		Node link(Node node, uint32_t level, uint32_t subtree) const;
+	};
+
+	// placement of a volume inside its octree, shared by the builders and the octree cache
+	struct OctreeLayout {
+		// center of the root node
 		glm::vec3 pos;
 		float voxelFreq;
+		// extent of a voxel per axis, differs between the axes for anisotropic volumes
+		glm::vec3 voxelSize;
+		// voxels per side of the root node, the volume is padded to the next power of two
 		int32_t numVoxelsSide;
+		// dimensions of the volume without padding
+		glm::uvec3 dims;
+		// number of levels below the root
+		uint32_t depth;
 
-		Octree(std::vector<uint32_t>* voxelData, glm::vec3 pos, float voxelFreq) {
-			this->pos = pos;
-			this->voxelFreq = voxelFreq;
-			numVoxelsSide = int32_t(std::cbrt(voxelData->size()));
-			nodes = create(*voxelData);
+		OctreeLayout() {
 		}
 
+		// pos is the center of the volume, the finest axis of the spacing is voxelFreq wide
+		OctreeLayout(glm::uvec3 dims, glm::vec3 spacing, glm::vec3 pos, float voxelFreq);
+
+		// node count of the complete tree of the same depth
+		uint64_t numDenseNodes() const {
+			return ((uint64_t(1) << (3 * (depth + 1))) - 1) / 7;
+		}
+	};
+
+	// pushes all voxels below the node rootCode on the builder's root level into the builder, slab holds the
+	// slices starting at firstSlice and has to contain every slice of the subtree that lies inside the volume
+	void buildSubtree(const VolumeView& slab, uint32_t firstSlice, const OctreeLayout& layout, SubtreeBuilder* builder, uint64_t rootCode);
+
+	// node encodings understood by the shader
+	const uint32_t NODE_ENCODING_STANDARD = 0;	// Node array
+	const uint32_t NODE_ENCODING_COMPACT = 1;	// CompactNodes
+
+	// compact word: bits 0-7 visible child mask, bit 8 far flag, bits 9-31 child pointer; the pointer counts
+	// sibling groups from the node's own group ((idx + 7) / 8) to its child group, 0 means no children, and
+	// indexes the far pointer table instead if the distance does not fit into 23 bit or the children are in
+	// another segment
+	const uint32_t COMPACT_FAR_BIT = 1 << 8;
+	const uint32_t COMPACT_POINTER_SHIFT = 9;
+	const uint32_t COMPACT_MAX_POINTER = (uint32_t(1) << (32 - COMPACT_POINTER_SHIFT)) - 1;
+
+	// a tree with grey scale colors in a third of the space of the Node array: one word per node and one 8 bit
+	// intensity per node in a parallel array, the shader reads everything as one word array per segment
+	struct CompactNodes {
+		// node words, followed by the far pointers and by the intensities packed 4 per word
+		std::vector<uint32_t> words;
+		uint32_t numNodes = 0;
+		uint32_t farPointerOffset = 0;
+		uint32_t attributeOffset = 0;
+	};
+
+	// encodes a whole tree of at most NODE_INDEX_MASK + 1 nodes or one segment of NodeSegments; child pointers into
+	// other segments are stored in the far pointer table as node handles. Returns false if a color is not grey scale
+	// (all channels equal), the far pointers overflow or the words exceed 32 bit offsets
+	bool encodeCompactNodes(const Node* nodes, uint64_t numNodes, CompactNodes* compact, uint32_t segment = 0);
+
+	// receives the node array of an Octree while it is assembled, e.g. to upload it before the build has finished;
+	// the array is filled front to back (level by level) and is neither moved nor reallocated while the Octree lives
+	class NodeListener {
+	public:
+		virtual ~NodeListener() {
+		}
+
+		virtual void nodesAllocated(uint64_t numNodes) = 0;
+
+		// nodes[0, numFinished) are final
+		virtual void nodesFinished(const Node* nodes, uint64_t numFinished) = 0;
+	};
+
+	class Octree : public OctreeLayout {
+	private:
+		std::vector<Node> nodes;
+		// index of the first node of every level, levelOffsets[depth + 1] is the node count
+		std::vector<uint32_t> levelOffsets;
+
+		// returns false and leaves the tree empty if it exceeds MAX_OCTREE_DEPTH or 32 bit node indices
+		bool create(const VolumeView& volume, uint32_t numThreads, NodeListener* listener);
+
+	public:
+		// builds the tree directly from the voxel view, the voxel array is neither copied nor modified,
+		// pos is the center of the volume and numThreads = 0 uses all hardware threads (the result is
+		// identical for every thread count); the padding of non power of two volumes is never stored,
+		// the optional listener sees every level as soon as it is final; check isValid() afterwards
+		Octree(const VolumeView& volume, glm::vec3 pos, float voxelFreq, uint32_t numThreads = 0, NodeListener* listener = nullptr);
+
 		~Octree() {
 		}
 
-		void removeEmptyNodes();
+		// false if the volume could not be turned into a tree
+		bool isValid() const {
+			return !nodes.empty();
+		}
 
 		void* data() {
 			return nodes.data();
@@ -49,5 +209,9 @@ namespace datastructure {
 		uint32_t numNodes() {
 			return nodes.size();
 		}
+
+		uint32_t levelOffset(uint32_t level) {
+			return levelOffsets[level];
+		}
 	};
-}
\ No newline at end of file
+}
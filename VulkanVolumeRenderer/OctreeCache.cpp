@@ -0,0 +1,176 @@
+#include "OctreeCache.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "Parallel.hpp"
+
+namespace datastructure {
+
+	namespace {
+		// bytes hashed per task, the chunk hashes are combined in file order
+		const uint64_t HASH_CHUNK_SIZE = 16 * 1024 * 1024;
+
+		uint64_t mixHash(uint64_t hash, uint64_t value) {
+			value *= 0x87c37b91114253d5ull;
+			value = (value << 31) | (value >> 33);
+			value *= 0x4cf5ad432745937full;
+			hash ^= value;
+			hash = (hash << 27) | (hash >> 37);
+			return hash * 5 + 0x52dce729;
+		}
+
+		uint64_t hashBytes(const uint8_t* data, uint64_t size) {
+			uint64_t hash = size;
+			uint64_t pos = 0;
+			for (; pos + 8 <= size; pos += 8) {
+				uint64_t word;
+				std::memcpy(&word, data + pos, 8);
+				hash = mixHash(hash, word);
+			}
+			uint64_t tail = 0;
+			std::memcpy(&tail, data + pos, size_t(size - pos));
+			return mixHash(hash, tail);
+		}
+	}
+
+	bool makeOctreeCacheKey(std::string sourcePath, glm::vec3 pos, float voxelFreq, OctreeCacheKey* key) {
+		util::MappedFile source;
+		if (!source.open(sourcePath)) {
+			return false;
+		}
+
+		auto tStart = std::chrono::high_resolution_clock::now();
+
+		uint32_t numChunks = uint32_t((source.size() + HASH_CHUNK_SIZE - 1) / HASH_CHUNK_SIZE);
+		std::vector<uint64_t> chunkHashes(numChunks);
+		util::parallelFor(numChunks, 0, [&](uint32_t chunk) {
+			uint64_t begin = chunk * HASH_CHUNK_SIZE;
+			uint64_t end = std::min(begin + HASH_CHUNK_SIZE, source.size());
+			chunkHashes[chunk] = hashBytes(source.data() + begin, end - begin);
+		});
+
+		key->sourceHash = source.size();
+		for (uint64_t chunkHash : chunkHashes) {
+			key->sourceHash = mixHash(key->sourceHash, chunkHash);
+		}
+		key->sourceSize = source.size();
+		key->builderVersion = OCTREE_BUILDER_VERSION;
+		key->pos = pos;
+		key->voxelFreq = voxelFreq;
+
+		auto tEnd = std::chrono::high_resolution_clock::now();
+		std::cout << "Hashed " << sourcePath << " in " << std::chrono::duration<double, std::milli>(tEnd - tStart).count() << " ms" << std::endl;
+		return true;
+	}
+
+	bool OctreeCache::open(std::string filePath, const OctreeCacheKey& key) {
+		mappedNodes = nullptr;
+		mappedNumNodes = 0;
+		if (!file.open(filePath)) {
+			return false;
+		}
+
+		OctreeCacheHeader header;
+		if (file.size() < sizeof(OctreeCacheHeader)) {
+			std::cout << "Octree cache " << filePath << " is truncated, rebuilding" << std::endl;
+			file.close();
+			return false;
+		}
+		std::memcpy(&header, file.data(), sizeof(OctreeCacheHeader));
+
+		bool matches = std::memcmp(header.magic, OCTREE_CACHE_MAGIC, sizeof(header.magic)) == 0 &&
+			header.version == OCTREE_CACHE_VERSION &&
+			header.builderVersion == key.builderVersion &&
+			header.sourceHash == key.sourceHash &&
+			header.sourceSize == key.sourceSize &&
+			header.buildPos[0] == key.pos.x && header.buildPos[1] == key.pos.y && header.buildPos[2] == key.pos.z &&
+			header.buildVoxelFreq == key.voxelFreq;
+		if (!matches) {
+			std::cout << "Octree cache " << filePath << " is out of date, rebuilding" << std::endl;
+			file.close();
+			return false;
+		}
+
+		if (header.dataOffset % alignof(Node) != 0 || header.dataOffset > file.size() ||
+			(file.size() - header.dataOffset) / sizeof(Node) < header.numNodes || header.numNodes == 0) {
+			std::cout << "Octree cache " << filePath << " does not contain " << header.numNodes << " nodes, rebuilding" << std::endl;
+			file.close();
+			return false;
+		}
+
+		pos = glm::vec3(header.pos[0], header.pos[1], header.pos[2]);
+		voxelFreq = header.voxelFreq;
+		voxelSize = glm::vec3(header.voxelSize[0], header.voxelSize[1], header.voxelSize[2]);
+		numVoxelsSide = header.numVoxelsSide;
+		dims = glm::uvec3(header.dims[0], header.dims[1], header.dims[2]);
+		depth = header.depth;
+		mappedNodes = reinterpret_cast<const Node*>(file.data() + header.dataOffset);
+		mappedNumNodes = header.numNodes;
+
+		std::cout << "Octree loaded from cache " << filePath << ": " << mappedNumNodes << " nodes, depth " << depth << std::endl;
+		return true;
+	}
+
+	OctreeCacheHeader makeOctreeCacheHeader(const OctreeCacheKey& key, const OctreeLayout& layout, uint64_t numNodes) {
+		OctreeCacheHeader header = {};
+		std::memcpy(header.magic, OCTREE_CACHE_MAGIC, sizeof(header.magic));
+		header.version = OCTREE_CACHE_VERSION;
+		header.builderVersion = key.builderVersion;
+		header.depth = layout.depth;
+		header.sourceHash = key.sourceHash;
+		header.sourceSize = key.sourceSize;
+		header.buildVoxelFreq = key.voxelFreq;
+		header.voxelFreq = layout.voxelFreq;
+		header.numVoxelsSide = layout.numVoxelsSide;
+		for (int i = 0; i < 3; i++) {
+			header.buildPos[i] = key.pos[i];
+			header.pos[i] = layout.pos[i];
+			header.voxelSize[i] = layout.voxelSize[i];
+			header.dims[i] = layout.dims[i];
+		}
+		header.numNodes = numNodes;
+		header.dataOffset = sizeof(OctreeCacheHeader);
+		return header;
+	}
+
+	bool commitOctreeCache(std::string tmpPath, std::string filePath) {
+		// rename does not replace existing files on every platform
+		std::remove(filePath.c_str());
+		if (std::rename(tmpPath.c_str(), filePath.c_str()) != 0) {
+			std::cout << "Unable to move octree cache to " << filePath << "!" << std::endl;
+			std::remove(tmpPath.c_str());
+			return false;
+		}
+		std::cout << "Octree cached in " << filePath << std::endl;
+		return true;
+	}
+
+	bool writeOctreeCache(std::string filePath, const OctreeCacheKey& key, Octree& octree) {
+		OctreeCacheHeader header = makeOctreeCacheHeader(key, octree, octree.numNodes());
+
+		// a crash while writing must not leave a complete looking but damaged cache behind
+		std::string tmpPath = filePath + ".tmp";
+		{
+			std::ofstream fout(tmpPath, std::ofstream::out | std::ofstream::binary);
+			if (!fout.is_open()) {
+				std::cout << "Unable to create octree cache " << tmpPath << "!" << std::endl;
+				return false;
+			}
+			fout.write(reinterpret_cast<const char*>(&header), sizeof(OctreeCacheHeader));
+			fout.write(static_cast<const char*>(octree.data()), std::streamsize(header.numNodes * sizeof(Node)));
+			if (!fout.good()) {
+				std::cout << "Failed to write octree cache " << tmpPath << "!" << std::endl;
+				fout.close();
+				std::remove(tmpPath.c_str());
+				return false;
+			}
+		}
+		return commitOctreeCache(tmpPath, filePath);
+	}
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+
+#include "MappedFile.hpp"
+#include "Octree.hpp"
+
+namespace datastructure {
+	// octree cache file (*.octree): a fixed size header followed by the finished node array, the
+	// file is written next to the source volume and reused as long as its key matches
+	const char OCTREE_CACHE_MAGIC[4] = { 'V', 'O', 'C', 'T' };
+	const uint32_t OCTREE_CACHE_VERSION = 1;
+	const std::string OCTREE_CACHE_EXTENSION = ".octree";
+
+	// everything the finished tree depends on: the content of the source file, the builder and its arguments
+	struct OctreeCacheKey {
+		uint64_t sourceHash = 0;
+		uint64_t sourceSize = 0;
+		uint32_t builderVersion = OCTREE_BUILDER_VERSION;
+		glm::vec3 pos = glm::vec3(0.0f);
+		float voxelFreq = 0.0f;
+	};
+
+	struct OctreeCacheHeader {
+		char magic[4];
+		uint32_t version;
+		uint32_t builderVersion;
+		uint32_t depth;
+		uint64_t sourceHash;
+		uint64_t sourceSize;
+		float buildPos[3];		// pos argument of the build, part of the key
+		float buildVoxelFreq;	// voxelFreq argument of the build, part of the key
+		float pos[3];
+		float voxelFreq;
+		float voxelSize[3];
+		int32_t numVoxelsSide;
+		uint32_t dims[3];
+		uint32_t reserved;
+		uint64_t numNodes;
+		uint64_t dataOffset;	// byte offset of the node array from the start of the file
+	};
+	static_assert(sizeof(OctreeCacheHeader) == 112, "OctreeCacheHeader layout is part of the file format");
+
+	// hashes the raw bytes of the file at path in parallel, returns false if it cannot be read
+	bool makeOctreeCacheKey(std::string sourcePath, glm::vec3 pos, float voxelFreq, OctreeCacheKey* key);
+
+	// memory mapped cache file, the node array is used in place and stays valid until the cache is closed
+	class OctreeCache : public OctreeLayout {
+	private:
+		util::MappedFile file;
+		const Node* mappedNodes = nullptr;
+		uint64_t mappedNumNodes = 0;
+
+	public:
+		// maps the cache file, returns false if it is missing, damaged or was built from different inputs
+		bool open(std::string filePath, const OctreeCacheKey& key);
+
+		const Node* nodes() const {
+			return mappedNodes;
+		}
+
+		uint64_t numNodes() const {
+			return mappedNumNodes;
+		}
+	};
+
+	// header of a cache file holding numNodes nodes directly behind the header
+	OctreeCacheHeader makeOctreeCacheHeader(const OctreeCacheKey& key, const OctreeLayout& layout, uint64_t numNodes);
+
+	// replaces filePath by the completely written cache file tmpPath
+	bool commitOctreeCache(std::string tmpPath, std::string filePath);
+
+	// writes the finished tree to a temporary file that replaces filePath once it is complete
+	bool writeOctreeCache(std::string filePath, const OctreeCacheKey& key, Octree& octree);
+}
@@ -0,0 +1,144 @@
+#include "OctreeDag.hpp"
+
+#include <chrono>
+#include <iostream>
+#include <unordered_map>
+
+namespace datastructure {
+
+	namespace {
+		uint64_t mixHash(uint64_t hash, uint64_t value) {
+			value *= 0x87c37b91114253d5ull;
+			value = (value << 31) | (value >> 33);
+			value *= 0x4cf5ad432745937full;
+			hash ^= value;
+			hash = (hash << 27) | (hash >> 37);
+			return hash * 5 + 0x52dce729;
+		}
+
+		// the sibling groups of one level after their children have been merged, firstChild holds the rank
+		// of the child group within the merged next level or NO_CHILDREN
+		class GroupSet {
+		private:
+			uint32_t colorTolerance;
+			std::unordered_map<uint64_t, uint32_t> firstWithHash;
+			// next group with the same hash
+			std::vector<uint32_t> chains;
+
+			// transparent colors keep their own bucket so that merging never changes the visibility masks of the parents
+			uint64_t quantize(uint32_t color) const {
+				uint32_t bucket = colorTolerance + 1;
+				uint64_t quantized = ((color >> 24) / bucket) << 24 | (((color >> 16) & 0xFF) / bucket) << 16 | (((color >> 8) & 0xFF) / bucket) << 8 | ((color & 0xFF) / bucket);
+				return quantized | uint64_t(isTransparent(color)) << 32;
+			}
+
+			uint64_t hash(const Node* group) const {
+				uint64_t hash = 0;
+				for (uint32_t i = 0; i < 8; i++) {
+					hash = mixHash(hash, quantize(group[i].color));
+					hash = mixHash(hash, group[i].firstChild);
+					hash = mixHash(hash, group[i].childMasks);
+				}
+				return hash;
+			}
+
+			bool equal(const Node* a, const Node* b) const {
+				for (uint32_t i = 0; i < 8; i++) {
+					if (quantize(a[i].color) != quantize(b[i].color) || a[i].firstChild != b[i].firstChild || a[i].childMasks != b[i].childMasks) {
+						return false;
+					}
+				}
+				return true;
+			}
+
+		public:
+			std::vector<Node> groups;
+
+			GroupSet(uint32_t colorTolerance) {
+				this->colorTolerance = colorTolerance;
+			}
+
+			// returns the rank of the equal group, the group is added if there is none
+			uint32_t insert(const Node* group) {
+				uint64_t groupHash = hash(group);
+				auto first = firstWithHash.find(groupHash);
+				if (first != firstWithHash.end()) {
+					for (uint32_t rank = first->second; rank != UINT32_MAX; rank = chains[rank]) {
+						if (equal(group, &groups[size_t(rank) * 8])) {
+							return rank;
+						}
+					}
+				}
+				uint32_t rank = uint32_t(chains.size());
+				chains.push_back(first != firstWithHash.end() ? first->second : UINT32_MAX);
+				firstWithHash[groupHash] = rank;
+				groups.insert(groups.end(), group, group + 8);
+				return rank;
+			}
+		};
+	}
+
+	std::vector<Node> buildOctreeDag(const Node* nodes, uint64_t numNodes, uint32_t colorTolerance) {
+		auto tStart = std::chrono::high_resolution_clock::now();
+
+		// the levels of a tree are contiguous, every level holds the child groups of the previous one
+		std::vector<uint64_t> levelStarts = { 0, 1 };
+		while (levelStarts.back() < numNodes) {
+			uint64_t numGroups = 0;
+			for (uint64_t i = levelStarts[levelStarts.size() - 2]; i < levelStarts.back(); i++) {
+				numGroups += nodes[i].firstChild != 0;
+			}
+			if (numGroups == 0) {
+				break;
+			}
+			levelStarts.push_back(levelStarts.back() + 8 * numGroups);
+		}
+		uint32_t numLevels = uint32_t(levelStarts.size() - 1);
+
+		// bottom-up: the groups of a level are merged after the children they refer to
+		std::vector<GroupSet> levels(numLevels, GroupSet(colorTolerance));
+		std::vector<uint32_t> childRanks;
+		for (uint32_t level = numLevels - 1; level >= 1; level--) {
+			uint64_t levelStart = levelStarts[level];
+			uint64_t childLevelStart = levelStarts[level + 1];
+			std::vector<uint32_t> ranks(size_t((levelStarts[level + 1] - levelStart) / 8));
+			for (uint64_t group = 0; group < ranks.size(); group++) {
+				Node merged[8];
+				for (uint32_t i = 0; i < 8; i++) {
+					merged[i] = nodes[levelStart + group * 8 + i];
+					merged[i].firstChild = merged[i].firstChild == 0 ? NO_CHILDREN : childRanks[size_t((merged[i].firstChild - childLevelStart) / 8)];
+				}
+				ranks[size_t(group)] = levels[level].insert(merged);
+			}
+			childRanks.swap(ranks);
+		}
+
+		// the merged levels are stored one after another like the levels of the tree
+		std::vector<uint64_t> mergedStarts(numLevels + 1);
+		mergedStarts[0] = 0;
+		mergedStarts[1] = 1;
+		for (uint32_t level = 1; level < numLevels; level++) {
+			mergedStarts[level + 1] = mergedStarts[level] + levels[level].groups.size();
+		}
+		std::vector<Node> dag;
+		dag.reserve(size_t(mergedStarts[numLevels]));
+		Node root = nodes[0];
+		if (root.firstChild != 0) {
+			root.firstChild = uint32_t(mergedStarts[1] + 8 * childRanks[0]);
+		}
+		dag.push_back(root);
+		for (uint32_t level = 1; level < numLevels; level++) {
+			for (Node node : levels[level].groups) {
+				node.firstChild = node.firstChild == NO_CHILDREN ? 0 : uint32_t(mergedStarts[level + 1] + 8 * uint64_t(node.firstChild));
+				dag.push_back(node);
+			}
+			// release the level right away, the groups are copied into the result
+			std::vector<Node>().swap(levels[level].groups);
+		}
+
+		auto tEnd = std::chrono::high_resolution_clock::now();
+		std::cout << "Octree DAG: " << dag.size() << " of " << numNodes << " nodes (" << 100.0 * dag.size() / numNodes << "%), color tolerance "
+			<< colorTolerance << ", " << std::chrono::duration<double, std::milli>(tEnd - tStart).count() << " ms" << std::endl;
+		return dag;
+	}
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "Octree.hpp"
+
+namespace datastructure {
+	// merges identical subtrees of a finished tree into a directed acyclic graph: the levels are processed bottom-up
+	// and every sibling group that equals an earlier group of the same level (colors, masks and the already merged
+	// children) is replaced by a reference to it. The result keeps the level by level layout of the tree, children
+	// are always stored behind their parents, so it can be streamed, encoded compactly and traversed like a tree.
+	// With a colorTolerance > 0 groups are also merged if their colors fall into the same buckets of colorTolerance + 1
+	// values per channel, i.e. merged colors differ by at most colorTolerance per channel.
+	std::vector<Node> buildOctreeDag(const Node* nodes, uint64_t numNodes, uint32_t colorTolerance = 0);
+}
@@ -0,0 +1,236 @@
+#include "OctreeStreamBuilder.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "Octree.hpp"
+#include "OctreeCache.hpp"
+#include "Parallel.hpp"
+#include "VolumeFile.hpp"
+
+namespace datastructure {
+
+	namespace {
+		// thinnest slab, thinner slabs would split the volume into too many tiny subtrees
+		const uint32_t MIN_SLAB_SLICES = 16;
+
+		// nodes buffered while reading back spilled levels and writing the final tree
+		const size_t COPY_BUFFER_NODES = 1 << 20;
+
+		// spreads the bits of a coordinate to every third bit of a morton code
+		uint64_t expandMortonBits(uint32_t coordinate) {
+			uint64_t code = coordinate & 0x1fffff;
+			code = (code | (code << 32)) & 0x1f00000000ffffull;
+			code = (code | (code << 16)) & 0x1f0000ff0000ffull;
+			code = (code | (code << 8)) & 0x100f00f00f00f00full;
+			code = (code | (code << 4)) & 0x10c30c30c30c30c3ull;
+			code = (code | (code << 2)) & 0x1249249249249249ull;
+			return code;
+		}
+
+		uint64_t mortonCode(uint32_t x, uint32_t y, uint32_t z) {
+			return expandMortonBits(x) | (expandMortonBits(y) << 1) | (expandMortonBits(z) << 2);
+		}
+
+		// location of a subtree level in the spill file, in nodes
+		struct SpilledLevel {
+			uint64_t offset = 0;
+			uint64_t numNodes = 0;
+		};
+	}
+
+	bool buildOctreeOutOfCore(std::string volumePath, std::string cachePath, glm::vec3 pos, float voxelFreq, uint64_t memoryBudget, uint32_t numThreads) {
+		auto tStart = std::chrono::high_resolution_clock::now();
+
+		VolumeSlabReader reader;
+		if (!reader.open(volumePath)) {
+			return false;
+		}
+		const VolumeView& info = reader.info();
+		if (std::max(info.dims.x, std::max(info.dims.y, info.dims.z)) > (uint32_t(1) << MAX_OCTREE_DEPTH)) {
+			std::cout << volumePath << " exceeds the maximum of " << (1 << MAX_OCTREE_DEPTH) << " voxels per side!" << std::endl;
+			return false;
+		}
+		OctreeLayout layout(info.dims, info.spacing, pos, voxelFreq);
+		uint32_t depth = layout.depth;
+		if (numThreads == 0) {
+			numThreads = util::defaultThreadCount();
+		}
+
+		OctreeCacheKey key;
+		if (!makeOctreeCacheKey(volumePath, pos, voxelFreq, &key)) {
+			return false;
+		}
+
+		// a slab slice costs its voxels plus roughly twice their size in nodes while its subtrees are built,
+		// slabs are a power of two thick so that every slab holds complete subtrees
+		uint64_t sliceCost = reader.sliceSize() + uint64_t(info.dims.x) * info.dims.y * sizeof(Node) * 2;
+		uint32_t slabSlices = uint32_t(layout.numVoxelsSide);
+		while (slabSlices > MIN_SLAB_SLICES && slabSlices * sliceCost > memoryBudget) {
+			slabSlices /= 2;
+		}
+		// thick slabs of small volumes would leave most threads idle
+		while (slabSlices > MIN_SLAB_SLICES && (uint64_t(layout.numVoxelsSide) / slabSlices) * (layout.numVoxelsSide / slabSlices) < uint64_t(numThreads) * 8) {
+			slabSlices /= 2;
+		}
+		uint32_t slabLevel = depth;
+		while ((uint32_t(1) << (depth - slabLevel)) < slabSlices) {
+			slabLevel--;
+		}
+		uint32_t subtreesPerSide = uint32_t(1) << slabLevel;
+		uint32_t numSubtrees = uint32_t(1) << (3 * slabLevel);
+
+		std::cout << "Streaming octree build of " << volumePath << ": " << info.dims.x << "x" << info.dims.y << "x" << info.dims.z
+			<< " voxels in slabs of " << slabSlices << " slices (" << slabSlices * sliceCost / 1000000 << " MB) on " << numThreads << " threads" << std::endl;
+
+		// subtrees below the slab level are indexed by the morton code of their root, subtrees that only
+		// cover padding are never built and keep an empty root without children
+		std::vector<Node> roots(numSubtrees);
+		std::vector<uint8_t> rootsOccupied(numSubtrees, 0);
+		for (Node& root : roots) {
+			root.color = 0;
+			root.firstChild = NO_CHILDREN;
+			root.childMasks = 0;
+		}
+		// spilled subtree levels, indexed by subtree * (depth + 1) + level
+		std::vector<SpilledLevel> spilledLevels(uint64_t(numSubtrees) * (depth + 1));
+		SubtreeLinker linker(slabLevel, depth, numSubtrees);
+
+		std::string spillPath = cachePath + ".spill";
+		std::ofstream spill(spillPath, std::ofstream::out | std::ofstream::binary);
+		if (!spill.is_open()) {
+			std::cout << "Unable to create temporary file " << spillPath << "!" << std::endl;
+			return false;
+		}
+		uint64_t numSpilledNodes = 0;
+
+		std::vector<uint8_t> slabVoxels(size_t(slabSlices * reader.sliceSize()));
+		for (uint32_t slab = 0; slab * slabSlices < info.dims.z; slab++) {
+			uint32_t firstSlice = slab * slabSlices;
+			uint32_t numSlices = std::min(slabSlices, info.dims.z - firstSlice);
+			if (!reader.readSlices(firstSlice, numSlices, slabVoxels.data())) {
+				std::cout << "Failed to read slices " << firstSlice << " to " << firstSlice + numSlices - 1 << " of " << volumePath << "!" << std::endl;
+				spill.close();
+				std::remove(spillPath.c_str());
+				return false;
+			}
+			VolumeView slabView = info;
+			slabView.data = slabVoxels.data();
+			slabView.dims.z = numSlices;
+
+			std::vector<uint64_t> codes;
+			for (uint32_t y = 0; y < subtreesPerSide && y * slabSlices < info.dims.y; y++) {
+				for (uint32_t x = 0; x < subtreesPerSide && x * slabSlices < info.dims.x; x++) {
+					codes.push_back(mortonCode(x, y, slab));
+				}
+			}
+			std::vector<SubtreeBuilder> builders(codes.size(), SubtreeBuilder(slabLevel, depth));
+			util::parallelFor(uint32_t(codes.size()), numThreads, [&](uint32_t task) {
+				buildSubtree(slabView, firstSlice, layout, &builders[task], codes[task]);
+			});
+
+			for (size_t task = 0; task < codes.size(); task++) {
+				uint32_t subtree = uint32_t(codes[task]);
+				roots[subtree] = builders[task].root;
+				rootsOccupied[subtree] = builders[task].rootOccupied;
+				for (uint32_t level = slabLevel + 1; level <= depth; level++) {
+					const std::vector<Node>& nodes = builders[task].levels[level];
+					SpilledLevel& spilledLevel = spilledLevels[uint64_t(subtree) * (depth + 1) + level];
+					spilledLevel.offset = numSpilledNodes;
+					spilledLevel.numNodes = nodes.size();
+					linker.setSubtreeGroups(subtree, level, nodes.size() / 8);
+					spill.write(reinterpret_cast<const char*>(nodes.data()), std::streamsize(nodes.size() * sizeof(Node)));
+					numSpilledNodes += nodes.size();
+				}
+			}
+		}
+		spill.close();
+		if (!spill.good()) {
+			std::cout << "Failed to write temporary file " << spillPath << "!" << std::endl;
+			std::remove(spillPath.c_str());
+			return false;
+		}
+
+		// the levels above the slab level are built from the subtree roots as in the in-memory builder
+		linker.computeSubtreeOffsets();
+		SubtreeBuilder top(0, depth);
+		for (uint32_t subtree = 0; subtree < numSubtrees; subtree++) {
+			top.push(slabLevel, subtree, linker.subtreeRoot(subtree, roots[subtree]), rootsOccupied[subtree] != 0);
+		}
+		for (uint32_t level = 1; level <= slabLevel; level++) {
+			linker.setTopGroups(level, top.levels[level].size() / 8);
+		}
+		uint64_t numNodes = linker.computeGroupBases();
+		if (numNodes > UINT32_MAX) {
+			std::cout << "The octree of " << volumePath << " has " << numNodes << " nodes, node indices are limited to 32 bit!" << std::endl;
+			std::remove(spillPath.c_str());
+			return false;
+		}
+
+		// final pass: every level is the concatenation of the spilled subtree levels in morton order
+		std::string tmpPath = cachePath + ".tmp";
+		std::ifstream spilled(spillPath, std::ifstream::in | std::ifstream::binary);
+		std::ofstream fout(tmpPath, std::ofstream::out | std::ofstream::binary);
+		if (!spilled.is_open() || !fout.is_open()) {
+			std::cout << "Unable to create octree cache " << tmpPath << "!" << std::endl;
+			std::remove(spillPath.c_str());
+			return false;
+		}
+		OctreeCacheHeader header = makeOctreeCacheHeader(key, layout, numNodes);
+		fout.write(reinterpret_cast<const char*>(&header), sizeof(OctreeCacheHeader));
+
+		std::vector<Node> buffer;
+		buffer.reserve(COPY_BUFFER_NODES);
+		auto flush = [&]() {
+			fout.write(reinterpret_cast<const char*>(buffer.data()), std::streamsize(buffer.size() * sizeof(Node)));
+			buffer.clear();
+		};
+		buffer.push_back(linker.link(top.root, 0, 0));
+		for (uint32_t level = 1; level <= slabLevel; level++) {
+			for (const Node& node : top.levels[level]) {
+				buffer.push_back(linker.link(node, level, 0));
+				if (buffer.size() == COPY_BUFFER_NODES) {
+					flush();
+				}
+			}
+		}
+		std::vector<Node> chunk(COPY_BUFFER_NODES);
+		for (uint32_t level = slabLevel + 1; level <= depth; level++) {
+			for (uint32_t subtree = 0; subtree < numSubtrees; subtree++) {
+				const SpilledLevel& spilledLevel = spilledLevels[uint64_t(subtree) * (depth + 1) + level];
+				spilled.seekg(std::streamoff(spilledLevel.offset * sizeof(Node)), std::ifstream::beg);
+				for (uint64_t done = 0; done < spilledLevel.numNodes;) {
+					size_t count = size_t(std::min<uint64_t>(COPY_BUFFER_NODES, spilledLevel.numNodes - done));
+					spilled.read(reinterpret_cast<char*>(chunk.data()), std::streamsize(count * sizeof(Node)));
+					for (size_t i = 0; i < count; i++) {
+						buffer.push_back(linker.link(chunk[i], level, subtree));
+						if (buffer.size() == COPY_BUFFER_NODES) {
+							flush();
+						}
+					}
+					done += count;
+				}
+			}
+		}
+		flush();
+
+		bool success = spilled.good() && fout.good();
+		spilled.close();
+		fout.close();
+		std::remove(spillPath.c_str());
+		if (!success) {
+			std::cout << "Failed to write octree cache " << tmpPath << "!" << std::endl;
+			std::remove(tmpPath.c_str());
+			return false;
+		}
+
+		auto tEnd = std::chrono::high_resolution_clock::now();
+		std::cout << "Octree built: " << numNodes << " nodes, depth " << depth << ", "
+			<< std::chrono::duration<double, std::milli>(tEnd - tStart).count() << " ms" << std::endl;
+		return commitOctreeCache(tmpPath, cachePath);
+	}
+}
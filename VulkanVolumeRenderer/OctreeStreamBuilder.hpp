@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+
+namespace datastructure {
+	// memory used by the streaming builder when no budget is given
+	const uint64_t DEFAULT_STREAM_MEMORY_BUDGET = uint64_t(4) << 30;
+
+	// builds the octree of a .vvol file that does not have to fit into memory and writes it as an octree cache
+	// file: the volume is read in slabs of slices, the subtrees of every slab are built in parallel and spilled to
+	// a temporary file, and a final pass concatenates the spilled levels into the breadth first node array.
+	// Memory stays close to memoryBudget, the result is identical to the in-memory builder.
+	bool buildOctreeOutOfCore(std::string volumePath, std::string cachePath, glm::vec3 pos, float voxelFreq,
+		uint64_t memoryBudget = DEFAULT_STREAM_MEMORY_BUDGET, uint32_t numThreads = 0);
+}
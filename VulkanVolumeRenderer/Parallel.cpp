@@ -0,0 +1,44 @@
+#include "Parallel.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace util {
+	uint32_t defaultThreadCount() {
+		return std::max(1u, std::thread::hardware_concurrency());
+	}
+
+	void parallelFor(uint32_t count, uint32_t numThreads, const std::function<void(uint32_t)>& fn) {
+		if (numThreads == 0) {
+			numThreads = defaultThreadCount();
+		}
+		numThreads = std::min(numThreads, count);
+
+		if (numThreads <= 1) {
+			for (uint32_t i = 0; i < count; i++) {
+				fn(i);
+			}
+			return;
+		}
+
+		std::atomic<uint32_t> nextTask(0);
+		auto worker = [&]() {
+			for (uint32_t i = nextTask++; i < count; i = nextTask++) {
+				fn(i);
+			}
+		};
+
+		// the calling thread works as well instead of only waiting for the others
+		std::vector<std::thread> threads;
+		threads.reserve(numThreads - 1);
+		for (uint32_t t = 1; t < numThreads; t++) {
+			threads.emplace_back(worker);
+		}
+		worker();
+		for (auto& thread : threads) {
+			thread.join();
+		}
+	}
+}
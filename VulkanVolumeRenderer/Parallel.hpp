@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+
+namespace util {
+	// number of worker threads used when a thread count of 0 is requested (all hardware threads)
+	uint32_t defaultThreadCount();
+
+	// calls fn(i) for every i in [0, count) using up to numThreads threads (0 = defaultThreadCount()),
+	// tasks are handed out one at a time so that threads finishing early pick up the remaining work
+	void parallelFor(uint32_t count, uint32_t numThreads, const std::function<void(uint32_t)>& fn);
+}
@@ -0,0 +1,200 @@
+#include "StorageBufferUploader.h"
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+
+#include "utility.hpp"
+
+// private
+
+void StorageBufferUploader::submitChunk(Chunk *chunk) {
+	// chunks never cross the end of a segment
+	VkDeviceSize offset = submittedSize - segmentStarts[submitSegment];
+	VkDeviceSize size = std::min(chunkSize, availableSizes[submitSegment] - offset);
+	memcpy(chunk->staging.mapped, sources[submitSegment] + offset, size_t(size));
+	vk::Buffer& segment = (*segments)[submitSegment];
+
+	VkCommandBufferBeginInfo cmdBufInfo = vkTools::initializers::commandBufferBeginInfo();
+	VK_CHECK_RESULT(vkBeginCommandBuffer(chunk->commandBuffer, &cmdBufInfo));
+	VkBufferCopy copyRegion = {};
+	copyRegion.srcOffset = 0;
+	copyRegion.dstOffset = offset;
+	copyRegion.size = size;
+	vkCmdCopyBuffer(chunk->commandBuffer, chunk->staging.buffer, segment.buffer, 1, &copyRegion);
+
+	// makes the copy available before the fence signals, the compute shader only reads ranges whose fence was seen
+	VkBufferMemoryBarrier barrier = vkTools::initializers::bufferMemoryBarrier();
+	barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barrier.dstAccessMask = 0;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.buffer = segment.buffer;
+	barrier.offset = offset;
+	barrier.size = size;
+	vkCmdPipelineBarrier(chunk->commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, VK_FLAGS_NONE, 0, nullptr, 1, &barrier, 0, nullptr);
+	VK_CHECK_RESULT(vkEndCommandBuffer(chunk->commandBuffer));
+
+	VkSubmitInfo submitInfo = vkTools::initializers::submitInfo();
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &chunk->commandBuffer;
+	VK_CHECK_RESULT(vkResetFences(vulkanDevice->logicalDevice, 1, &chunk->fence));
+	VK_CHECK_RESULT(vkQueueSubmit(transferQueue, 1, &submitInfo, chunk->fence));
+
+	submittedSize += size;
+	if (submittedSize == segmentStarts[submitSegment + 1]) {
+		submitSegment++;
+	}
+	chunk->end = submittedSize;
+	chunk->inFlight = true;
+}
+
+// public
+
+StorageBufferUploader::StorageBufferUploader(vk::VulkanDevice *vulkanDevice, std::vector<vk::Buffer> *segments, VkDeviceSize segmentSize, uint32_t maxSegments, uint32_t numChunks, VkDeviceSize chunkSize) {
+	this->vulkanDevice = vulkanDevice;
+	this->segments = segments;
+	this->maxSegmentSize = segmentSize;
+	this->maxSegments = maxSegments;
+	this->chunkSize = chunkSize;
+
+	vkGetDeviceQueue(vulkanDevice->logicalDevice, vulkanDevice->queueFamilyIndices.transfer, 0, &transferQueue);
+	commandPool = vulkanDevice->createCommandPool(vulkanDevice->queueFamilyIndices.transfer);
+
+	chunks.resize(numChunks);
+	for (Chunk& chunk : chunks) {
+		// staging chunks stay mapped for the lifetime of the uploader
+		VK_CHECK_RESULT(vulkanDevice->createBuffer(
+			VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			&chunk.staging,
+			chunkSize));
+		VK_CHECK_RESULT(chunk.staging.map());
+		chunk.commandBuffer = util::createCommandBuffer(vulkanDevice->logicalDevice, commandPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, false);
+		VkFenceCreateInfo fenceCreateInfo = vkTools::initializers::fenceCreateInfo(VK_FENCE_CREATE_SIGNALED_BIT);
+		VK_CHECK_RESULT(vkCreateFence(vulkanDevice->logicalDevice, &fenceCreateInfo, nullptr, &chunk.fence));
+	}
+}
+
+StorageBufferUploader::~StorageBufferUploader() {
+	for (Chunk& chunk : chunks) {
+		vkWaitForFences(vulkanDevice->logicalDevice, 1, &chunk.fence, VK_TRUE, UINT64_MAX);
+		vkDestroyFence(vulkanDevice->logicalDevice, chunk.fence, nullptr);
+		chunk.staging.unmap();
+		chunk.staging.destroy();
+	}
+	vkDestroyCommandPool(vulkanDevice->logicalDevice, commandPool, nullptr);
+}
+
+void StorageBufferUploader::begin(const std::vector<VkDeviceSize>& sizes) {
+	VkDeviceSize size = 0;
+	VkDeviceSize largestSegment = 0;
+	for (VkDeviceSize segmentSize : sizes) {
+		size += segmentSize;
+		largestSegment = std::max(largestSegment, segmentSize);
+	}
+
+	// the largest device local heap bounds what can be allocated at all
+	VkDeviceSize heapSize = 0;
+	const VkPhysicalDeviceMemoryProperties& memoryProperties = vulkanDevice->memoryProperties;
+	for (uint32_t i = 0; i < memoryProperties.memoryHeapCount; i++) {
+		if (memoryProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+			heapSize = std::max(heapSize, memoryProperties.memoryHeaps[i].size);
+		}
+	}
+	if (sizes.empty() || sizes.size() > maxSegments || largestSegment > maxSegmentSize || size > heapSize) {
+		std::cout << "Storage buffer of " << size / 1000000.0 << " MB in " << sizes.size() << " segments does not fit the device: "
+			<< maxSegments << " buffers of " << maxSegmentSize / 1000000.0 << " MB (maxStorageBufferRange "
+			<< vulkanDevice->properties.limits.maxStorageBufferRange / 1000000.0 << " MB), device local heap of "
+			<< heapSize / 1000000.0 << " MB" << std::endl;
+		vkTools::exitFatal("The octree of " + std::to_string(size / 1000000) + " MB exceeds the storage buffer limits of the device", "Fatal error");
+	}
+
+	totalSize = size;
+	submittedSize = 0;
+	residentSize = 0;
+	submitSegment = 0;
+	sources.assign(sizes.size(), nullptr);
+	availableSizes.assign(sizes.size(), 0);
+	segmentStarts.assign(1, 0);
+	for (vk::Buffer& segment : *segments) {
+		segment.destroy();
+	}
+	segments->assign(sizes.size(), vk::Buffer());
+	for (size_t i = 0; i < sizes.size(); i++) {
+		segmentStarts.push_back(segmentStarts.back() + sizes[i]);
+		VK_CHECK_RESULT(vulkanDevice->createBuffer(
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+			&(*segments)[i],
+			std::max<VkDeviceSize>(sizes[i], 1),
+			nullptr,
+			{ vulkanDevice->queueFamilyIndices.transfer, vulkanDevice->queueFamilyIndices.compute }));
+	}
+}
+
+void StorageBufferUploader::setAvailable(uint32_t segment, const void *source, VkDeviceSize available) {
+	sources[segment] = static_cast<const uint8_t*>(source);
+	availableSizes[segment] = std::min(available, segmentStarts[segment + 1] - segmentStarts[segment]);
+}
+
+void StorageBufferUploader::update() {
+	while (chunks[nextRetire].inFlight && vkGetFenceStatus(vulkanDevice->logicalDevice, chunks[nextRetire].fence) == VK_SUCCESS) {
+		chunks[nextRetire].inFlight = false;
+		residentSize = chunks[nextRetire].end;
+		nextRetire = (nextRetire + 1) % chunks.size();
+	}
+
+	// while more data of the segment is expected only full chunks are sent, so no chunk is wasted on a small
+	// remainder, unless the transfer queue would idle; this flushes e.g. the top levels of a tree that is still
+	// being assembled
+	while (!chunks[nextSubmit].inFlight && submitSegment < sources.size()) {
+		VkDeviceSize segmentSize = segmentStarts[submitSegment + 1] - segmentStarts[submitSegment];
+		VkDeviceSize pending = segmentStarts[submitSegment] + availableSizes[submitSegment] - submittedSize;
+		if (pending == 0 || (pending < chunkSize && availableSizes[submitSegment] < segmentSize && chunks[nextRetire].inFlight)) {
+			break;
+		}
+		submitChunk(&chunks[nextSubmit]);
+		nextSubmit = (nextSubmit + 1) % chunks.size();
+	}
+}
+
+void StorageBufferUploader::waitResident(VkDeviceSize size) {
+	size = std::min(size, totalSize);
+	update();
+	while (residentSize < size) {
+		if (!chunks[nextRetire].inFlight) {
+			// nothing in flight means that the requested range is not available yet
+			break;
+		}
+		VK_CHECK_RESULT(vkWaitForFences(vulkanDevice->logicalDevice, 1, &chunks[nextRetire].fence, VK_TRUE, UINT64_MAX));
+		update();
+	}
+}
+
+uint32_t StorageBufferUploader::residentSegments() const {
+	uint32_t segment = 0;
+	while (segment < sources.size() && segmentStarts[segment + 1] <= residentSize) {
+		segment++;
+	}
+	return segment;
+}
+
+VkDeviceSize StorageBufferUploader::residentInSegment() const {
+	uint32_t segment = residentSegments();
+	return segment < sources.size() ? residentSize - segmentStarts[segment] : 0;
+}
+
+void StorageBufferUploader::nodesAllocated(uint64_t numNodes) {
+	streaming = numNodes * sizeof(datastructure::Node) <= maxSegmentSize;
+	if (streaming) {
+		begin({ numNodes * sizeof(datastructure::Node) });
+	}
+}
+
+void StorageBufferUploader::nodesFinished(const datastructure::Node *nodes, uint64_t numFinished) {
+	if (streaming) {
+		setAvailable(0, nodes, numFinished * sizeof(datastructure::Node));
+		update();
+	}
+}
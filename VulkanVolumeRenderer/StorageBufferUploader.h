@@ -0,0 +1,99 @@
+#pragma once
+
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "vulkantools.h"
+#include "vulkandevice.hpp"
+
+#include "Octree.hpp"
+
+// streams large host arrays into device local storage buffers through a fixed ring of staging chunks on the
+// transfer queue; the buffers are filled one after another and front to back, so the resident part is always a
+// prefix that can be used while the rest is still in flight, and host visible memory never exceeds the ring. Every
+// segment is a buffer of its own of at most segmentSize bytes, so that no buffer exceeds the range of a binding
+class StorageBufferUploader : public datastructure::NodeListener {
+private:
+	struct Chunk {
+		vk::Buffer staging;
+		VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+		VkFence fence = VK_NULL_HANDLE;
+		VkDeviceSize end = 0;		// end of the copied range in the target buffer
+		bool inFlight = false;
+	};
+
+	vk::VulkanDevice *vulkanDevice;
+	std::vector<vk::Buffer> *segments;
+	VkDeviceSize maxSegmentSize;
+	uint32_t maxSegments;
+	VkQueue transferQueue;
+	VkCommandPool commandPool;
+	VkDeviceSize chunkSize;
+	std::vector<Chunk> chunks;
+	// chunks are submitted and retired in ring order
+	uint32_t nextSubmit = 0;
+	uint32_t nextRetire = 0;
+
+	// the segments of the current upload, positions count across all of them
+	std::vector<const uint8_t*> sources;
+	std::vector<VkDeviceSize> availableSizes;
+	std::vector<VkDeviceSize> segmentStarts;
+	// segment that receives the next chunk
+	uint32_t submitSegment = 0;
+	VkDeviceSize totalSize = 0;
+	VkDeviceSize submittedSize = 0;
+	VkDeviceSize residentSize = 0;
+	// the octree passed to the listener fits into one segment and is streamed while it is assembled
+	bool streaming = false;
+
+	void submitChunk(Chunk *chunk);
+
+public:
+	// the segments are created in begin() as storage buffers shared between the transfer and the compute queue family
+	StorageBufferUploader(vk::VulkanDevice *vulkanDevice, std::vector<vk::Buffer> *segments, VkDeviceSize segmentSize, uint32_t maxSegments, uint32_t numChunks = 4, VkDeviceSize chunkSize = 16 * 1024 * 1024);
+
+	// waits for the chunks in flight
+	~StorageBufferUploader();
+
+	// creates one segment per size, exits with a report of the device limits if they cannot hold the data
+	void begin(const std::vector<VkDeviceSize>& sizes);
+
+	// source[0, available) of the segment may be uploaded, source has to stay valid until the upload is finished
+	void setAvailable(uint32_t segment, const void *source, VkDeviceSize available);
+
+	// retires completed chunks and submits available data to free chunks without blocking
+	void update();
+
+	// blocks until at least size bytes (or everything) are resident
+	void waitResident(VkDeviceSize size);
+
+	// segments that are completely resident
+	uint32_t residentSegments() const;
+
+	// resident bytes of the first segment that is not completely resident
+	VkDeviceSize residentInSegment() const;
+
+	VkDeviceSize getMaxSegmentSize() const {
+		return maxSegmentSize;
+	}
+
+	uint32_t getMaxSegments() const {
+		return maxSegments;
+	}
+
+	// false until begin() was called
+	bool started() const {
+		return !segmentStarts.empty();
+	}
+
+	bool finished() const {
+		return started() && residentSize == totalSize;
+	}
+
+	// NodeListener, uploads the levels of an octree while it is being assembled if it fits into a single segment,
+	// larger trees have to be split into subtrees once they are finished
+	virtual void nodesAllocated(uint64_t numNodes);
+
+	virtual void nodesFinished(const datastructure::Node *nodes, uint64_t numFinished);
+};
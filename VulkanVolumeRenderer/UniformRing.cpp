@@ -0,0 +1,62 @@
+#include "UniformRing.h"
+
+#include <assert.h>
+#include <cstring>
+
+// public
+
+UniformRing::UniformRing(vk::VulkanDevice *vulkanDevice, VkDeviceSize blockSize, uint32_t numSlices) {
+	assert(blockSize % sizeof(uint32_t) == 0);
+	this->blockSize = blockSize;
+	this->numSlices = numSlices;
+
+	VkDeviceSize alignment = vulkanDevice->properties.limits.minUniformBufferOffsetAlignment;
+	sliceSize = (blockSize + alignment - 1) / alignment * alignment;
+
+	// coherent, so the writes need no flush; the buffer stays mapped for the lifetime of the ring
+	VK_CHECK_RESULT(vulkanDevice->createBuffer(
+		VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+		&buffer,
+		sliceSize * numSlices));
+	VK_CHECK_RESULT(buffer.map());
+
+	descriptor.buffer = buffer.buffer;
+	descriptor.offset = 0;
+	descriptor.range = blockSize;
+
+	written.resize(numSlices);
+}
+
+UniformRing::~UniformRing() {
+	buffer.unmap();
+	buffer.destroy();
+}
+
+void UniformRing::write(uint32_t slice, const void *block) {
+	const uint32_t *source = static_cast<const uint32_t*>(block);
+	uint32_t *target = reinterpret_cast<uint32_t*>(static_cast<uint8_t*>(buffer.mapped) + sliceSize * slice);
+	std::vector<uint32_t>& last = written[slice];
+	size_t numWords = size_t(blockSize / sizeof(uint32_t));
+
+	if (last.empty()) {
+		memcpy(target, source, size_t(blockSize));
+		last.assign(source, source + numWords);
+		return;
+	}
+
+	// copies every run of changed words at once
+	for (size_t i = 0; i < numWords;) {
+		if (source[i] == last[i]) {
+			i++;
+			continue;
+		}
+		size_t end = i + 1;
+		while (end < numWords && source[end] != last[end]) {
+			end++;
+		}
+		memcpy(target + i, source + i, (end - i) * sizeof(uint32_t));
+		memcpy(last.data() + i, source + i, (end - i) * sizeof(uint32_t));
+		i = end;
+	}
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+#include "vulkantools.h"
+#include "vulkandevice.hpp"
+
+// persistently mapped ring of uniform block slices, one per frame in flight; rewrite a slice only after its frame finished
+class UniformRing {
+private:
+	vk::Buffer buffer;
+	VkDeviceSize blockSize;
+	VkDeviceSize sliceSize;
+	uint32_t numSlices;
+	// last block written to each slice, empty until the slice has been written completely once
+	std::vector<std::vector<uint32_t>> written;
+
+public:
+	// descriptor of the block in the first slice, the dynamic offset of a slice is added when binding
+	VkDescriptorBufferInfo descriptor;
+
+	// blockSize has to be a multiple of 4 bytes, the slices are aligned to minUniformBufferOffsetAlignment
+	UniformRing(vk::VulkanDevice *vulkanDevice, VkDeviceSize blockSize, uint32_t numSlices);
+
+	~UniformRing();
+
+	// copies the words of block that differ from the last block written to the slice, the frame reading the
+	// slice must have finished
+	void write(uint32_t slice, const void *block);
+
+	uint32_t getDynamicOffset(uint32_t slice) const {
+		return uint32_t(sliceSize * slice);
+	}
+};
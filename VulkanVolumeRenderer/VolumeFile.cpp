@@ -0,0 +1,196 @@
+#include "VolumeFile.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include "DatastructureCreator.hpp"
+
+namespace datastructure {
+
+	uint32_t voxelTypeSize(VoxelType type) {
+		switch (type) {
+		case VOXEL_TYPE_UINT8:
+			return 1;
+		case VOXEL_TYPE_RGBA8:
+			return 4;
+		}
+		return 0;
+	}
+
+	namespace {
+		// copies the dimensions, type, spacing and origin of a valid header into volume
+		bool readVolumeHeader(const VolumeHeader& header, uint64_t fileSize, const std::string& filePath, VolumeView* volume) {
+			if (std::memcmp(header.magic, VOLUME_FILE_MAGIC, sizeof(header.magic)) != 0) {
+				std::cout << filePath << " is not a volume file!" << std::endl;
+				return false;
+			}
+			if (header.version != VOLUME_FILE_VERSION) {
+				std::cout << "Unsupported volume file version " << header.version << " (expected " << VOLUME_FILE_VERSION << ")!" << std::endl;
+				return false;
+			}
+
+			uint32_t typeSize = voxelTypeSize(VoxelType(header.voxelType));
+			if (typeSize == 0) {
+				std::cout << "Unknown voxel type " << header.voxelType << " in " << filePath << "!" << std::endl;
+				return false;
+			}
+
+			volume->type = VoxelType(header.voxelType);
+			volume->dims = glm::uvec3(header.dims[0], header.dims[1], header.dims[2]);
+			volume->spacing = glm::vec3(header.spacing[0], header.spacing[1], header.spacing[2]);
+			volume->origin = glm::vec3(header.origin[0], header.origin[1], header.origin[2]);
+
+			// the voxel array must be aligned to its element size to be usable in place
+			uint64_t dataSize = volume->numVoxels() * typeSize;
+			if (header.dataOffset % typeSize != 0 || header.dataOffset > fileSize || fileSize - header.dataOffset < dataSize) {
+				std::cout << "Volume file " << filePath << " does not contain " << volume->numVoxels() << " voxels!" << std::endl;
+				return false;
+			}
+			return true;
+		}
+	}
+
+	// private
+	bool Volume::loadBinary(std::string filePath) {
+		if (!file.open(filePath)) {
+			std::cout << "Unable to open volume file " << filePath << "!" << std::endl;
+			return false;
+		}
+
+		if (file.size() < sizeof(VolumeHeader)) {
+			std::cout << "Volume file " << filePath << " is truncated!" << std::endl;
+			return false;
+		}
+
+		VolumeHeader header;
+		std::memcpy(&header, file.data(), sizeof(VolumeHeader));
+		if (!readVolumeHeader(header, file.size(), filePath, &volumeView)) {
+			return false;
+		}
+		volumeView.data = file.data() + header.dataOffset;
+		return true;
+	}
+
+	bool Volume::loadText(std::string filePath) {
+		parsedVoxels.clear();
+		if (!loadVoxelDataFromTxt(filePath, &parsedVoxels) || parsedVoxels.empty()) {
+			return false;
+		}
+
+		// legacy text files carry no header, they are always cubic
+		uint32_t numVoxelsSide = uint32_t(std::round(std::cbrt(double(parsedVoxels.size()))));
+		volumeView.data = parsedVoxels.data();
+		volumeView.type = VOXEL_TYPE_RGBA8;
+		volumeView.dims = glm::uvec3(numVoxelsSide);
+		volumeView.spacing = glm::vec3(1.0f);
+		volumeView.origin = glm::vec3(0.0f);
+		if (volumeView.numVoxels() != parsedVoxels.size()) {
+			std::cout << filePath << " contains " << parsedVoxels.size() << " voxels, which is not a cubic volume!" << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	// public
+	bool Volume::load(std::string filePath) {
+		auto tStart = std::chrono::high_resolution_clock::now();
+
+		bool isBinary = filePath.size() >= VOLUME_FILE_EXTENSION.size() &&
+			filePath.compare(filePath.size() - VOLUME_FILE_EXTENSION.size(), VOLUME_FILE_EXTENSION.size(), VOLUME_FILE_EXTENSION) == 0;
+		bool loaded = isBinary ? loadBinary(filePath) : loadText(filePath);
+		if (!loaded) {
+			volumeView = VolumeView();
+			return false;
+		}
+
+		auto tEnd = std::chrono::high_resolution_clock::now();
+		std::cout << "Loaded volume " << volumeView.dims.x << "x" << volumeView.dims.y << "x" << volumeView.dims.z
+			<< (isBinary ? " (mapped)" : " (parsed)") << " in "
+			<< std::chrono::duration<double, std::milli>(tEnd - tStart).count() << " ms" << std::endl;
+		return true;
+	}
+
+	bool VolumeSlabReader::open(std::string filePath) {
+		file.open(filePath, std::ifstream::in | std::ifstream::binary);
+		if (!file.is_open()) {
+			std::cout << "Unable to open volume file " << filePath << "!" << std::endl;
+			return false;
+		}
+
+		file.seekg(0, std::ifstream::end);
+		uint64_t fileSize = uint64_t(file.tellg());
+		file.seekg(0, std::ifstream::beg);
+
+		VolumeHeader header;
+		if (fileSize < sizeof(VolumeHeader) || !file.read(reinterpret_cast<char*>(&header), sizeof(VolumeHeader))) {
+			std::cout << "Volume file " << filePath << " is truncated!" << std::endl;
+			return false;
+		}
+		if (!readVolumeHeader(header, fileSize, filePath, &volumeInfo)) {
+			return false;
+		}
+		dataOffset = header.dataOffset;
+		return true;
+	}
+
+	bool VolumeSlabReader::readSlices(uint32_t firstSlice, uint32_t numSlices, void* dst) {
+		file.seekg(std::streamoff(dataOffset + firstSlice * sliceSize()), std::ifstream::beg);
+		file.read(static_cast<char*>(dst), std::streamsize(numSlices * sliceSize()));
+		return file.good();
+	}
+
+	bool writeVolumeFile(std::string filePath, const VolumeView& volume) {
+		std::ofstream fout(filePath, std::ofstream::out | std::ofstream::binary);
+		if (!fout.is_open()) {
+			std::cout << "Unable to create volume file " << filePath << "!" << std::endl;
+			return false;
+		}
+
+		VolumeHeader header = {};
+		std::memcpy(header.magic, VOLUME_FILE_MAGIC, sizeof(header.magic));
+		header.version = VOLUME_FILE_VERSION;
+		header.voxelType = volume.type;
+		for (int i = 0; i < 3; i++) {
+			header.dims[i] = volume.dims[i];
+			header.spacing[i] = volume.spacing[i];
+			header.origin[i] = volume.origin[i];
+		}
+		header.dataOffset = sizeof(VolumeHeader);
+
+		fout.write(reinterpret_cast<const char*>(&header), sizeof(VolumeHeader));
+		fout.write(static_cast<const char*>(volume.data), std::streamsize(volume.numVoxels() * voxelTypeSize(volume.type)));
+		if (!fout.good()) {
+			std::cout << "Failed to write volume file " << filePath << "!" << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	bool convertTxtToVolumeFile(std::string txtPath, std::string volumePath, glm::vec3 spacing, glm::vec3 origin) {
+		Volume source;
+		if (!source.load(txtPath)) {
+			return false;
+		}
+
+		// the text format only carries a gray value per voxel, so the red channel holds all information
+		const VolumeView& sourceView = source.view();
+		std::vector<uint8_t> intensities(sourceView.numVoxels());
+		for (uint64_t i = 0; i < intensities.size(); i++) {
+			intensities[i] = uint8_t(sourceView.voxel(i) >> 24);
+		}
+
+		VolumeView target = sourceView;
+		target.data = intensities.data();
+		target.type = VOXEL_TYPE_UINT8;
+		target.spacing = spacing;
+		target.origin = origin;
+		if (!writeVolumeFile(volumePath, target)) {
+			return false;
+		}
+		std::cout << "Converted " << txtPath << " to " << volumePath << std::endl;
+		return true;
+	}
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+
+#include "MappedFile.hpp"
+
+namespace datastructure {
+	// binary volume container (*.vvol): a fixed size header followed by the raw voxel array,
+	// voxels are stored with dims[0] as the fastest varying axis (same order as the legacy .txt files)
+	const char VOLUME_FILE_MAGIC[4] = { 'V', 'V', 'O', 'L' };
+	const uint32_t VOLUME_FILE_VERSION = 1;
+	const std::string VOLUME_FILE_EXTENSION = ".vvol";
+
+	enum VoxelType : uint32_t {
+		VOXEL_TYPE_UINT8 = 0,	// single intensity, replicated into all four channels when fetched
+		VOXEL_TYPE_RGBA8 = 1	// packed color as produced by vec4ToInt
+	};
+
+	struct VolumeHeader {
+		char magic[4];
+		uint32_t version;
+		uint32_t voxelType;
+		uint32_t dims[3];
+		float spacing[3];
+		float origin[3];
+		uint64_t dataOffset;	// byte offset of the voxel array from the start of the file
+	};
+	static_assert(sizeof(VolumeHeader) == 56, "VolumeHeader layout is part of the file format");
+
+	// non-owning view of a voxel array, either memory mapped from a .vvol file or parsed from text
+	struct VolumeView {
+		const void* data = nullptr;
+		VoxelType type = VOXEL_TYPE_RGBA8;
+		glm::uvec3 dims = glm::uvec3(0);
+		glm::vec3 spacing = glm::vec3(1.0f);
+		glm::vec3 origin = glm::vec3(0.0f);
+
+		uint64_t numVoxels() const {
+			return uint64_t(dims.x) * dims.y * dims.z;
+		}
+
+		// returns the packed RGBA color of the voxel at the linear index idx
+		uint32_t voxel(uint64_t idx) const {
+			if (type == VOXEL_TYPE_UINT8) {
+				return uint32_t(static_cast<const uint8_t*>(data)[idx]) * 0x01010101u;
+			}
+			return static_cast<const uint32_t*>(data)[idx];
+		}
+	};
+
+	uint32_t voxelTypeSize(VoxelType type);
+
+	// owns the storage behind a VolumeView: a file mapping for .vvol files, a parsed array for .txt files
+	class Volume {
+	private:
+		util::MappedFile file;
+		std::vector<uint32_t> parsedVoxels;
+		VolumeView volumeView;
+
+		bool loadBinary(std::string filePath);
+
+		bool loadText(std::string filePath);
+
+	public:
+		// loads .vvol files zero-copy through a memory mapping, everything else is parsed as legacy text
+		bool load(std::string filePath);
+
+		const VolumeView& view() const {
+			return volumeView;
+		}
+	};
+
+	// reads a .vvol file a few slices at a time for volumes that do not fit into memory
+	class VolumeSlabReader {
+	private:
+		std::ifstream file;
+		uint64_t dataOffset = 0;
+		// dimensions, type, spacing and origin of the file, data is always null
+		VolumeView volumeInfo;
+
+	public:
+		bool open(std::string filePath);
+
+		const VolumeView& info() const {
+			return volumeInfo;
+		}
+
+		uint64_t sliceSize() const {
+			return uint64_t(volumeInfo.dims.x) * volumeInfo.dims.y * voxelTypeSize(volumeInfo.type);
+		}
+
+		// reads numSlices slices starting at firstSlice into dst, which has to hold numSlices * sliceSize() bytes
+		bool readSlices(uint32_t firstSlice, uint32_t numSlices, void* dst);
+	};
+
+	bool writeVolumeFile(std::string filePath, const VolumeView& volume);
+
+	// one-shot conversion of a legacy semicolon separated .txt volume (e.g. datastructure_generator.py output)
+	bool convertTxtToVolumeFile(std::string txtPath, std::string volumePath, glm::vec3 spacing = glm::vec3(1.0f), glm::vec3 origin = glm::vec3(0.0f));
+}
@@ -55,8 +55,8 @@ bool VulkanBase::checkCommandBuffers() {
 }
 
 void VulkanBase::createCommandBuffers() {
-	// create one command buffer for each swap chain image and reuse it for rendering
-	drawCmdBuffers.resize(swapChain.imageCount);
+	// create command buffers for each swap chain image and frame in flight and reuse them for rendering
+	drawCmdBuffers.resize(swapChain.imageCount * MAX_FRAMES_IN_FLIGHT);
 
 	VkCommandBufferAllocateInfo cmdBufAllocateInfo =
 		vkTools::initializers::commandBufferAllocateInfo(
@@ -136,6 +136,8 @@ void VulkanBase::prepare() {
 
 	textureLoader = new vkTools::VulkanTextureLoader(vulkanDevice, queue, cmdPool);
 
+	profiler = new GpuProfiler(vulkanDevice, MAX_FRAMES_IN_FLIGHT);
+
 	if (enableTextOverlay) {
 		// load the text rendering shaders
 		std::vector<VkPipelineShaderStageCreateInfo> shaderStages;
@@ -151,6 +153,7 @@ void VulkanBase::prepare() {
 			&height,
 			shaderStages
 		);
+		textOverlayPass = profiler->addPass("text overlay", vulkanDevice->queueFamilyIndices.graphics);
 		updateTextOverlay();
 	}
 }
@@ -160,21 +163,29 @@ void VulkanBase::renderLoop() {
 	destHeight = height;
 	while (!glfwWindowShouldClose(window)) {
 		auto tStart = std::chrono::high_resolution_clock::now();
-		if (viewUpdated) {
-			viewUpdated = false;
-		}
 
 		glfwPollEvents();
+		// held movement keys only move the camera in camera.update() after a frame, so they have to keep the loop drawing
+		if (camera.moving()) {
+			viewUpdated = true;
+		}
 
+		frameSkipped = false;
 		render(tDelta);
+		if (frameSkipped) {
+			skippedFrames++;
+			if (idleTimeout < 0.0) {
+				glfwWaitEvents();
+			} else {
+				glfwWaitEventsTimeout(idleTimeout);
+			}
+			continue;
+		}
 		frameCounter++;
 		auto tEnd = std::chrono::high_resolution_clock::now();
 		tDelta = std::chrono::duration<double, std::milli>(tEnd - tStart).count();
 		frameTimer = (float)tDelta / 1000.0f;
 		camera.update(frameTimer);
-		if (camera.moving()) {
-			viewUpdated = true;
-		}
 
 		if (!paused) {
 			timer += timerSpeed * frameTimer;
@@ -188,9 +199,12 @@ void VulkanBase::renderLoop() {
 				std::string windowTitle = getWindowTitle();
 			}
 			lastFPS = roundf(1.0f / frameTimer);
+			lastFrameWaitTime = frameWaitTime / frameCounter;
+			lastCpuFrameTime = fpsTimer / frameCounter - lastFrameWaitTime;
 			updateTextOverlay();
 			fpsTimer = 0.0f;
 			frameCounter = 0;
+			frameWaitTime = 0.0;
 		}
 	}
 	// flush device, thus all resources can be freed 
@@ -201,54 +215,125 @@ void VulkanBase::updateTextOverlay() {
 	if (!enableTextOverlay)
 		return;
 
+	// the vertex buffer and the command buffers of the overlay are used by all frames in flight
+	waitForFrames();
+
 	textOverlay->beginTextUpdate();
 
 	textOverlay->addText(title, 5.0f, 5.0f, VulkanTextOverlay::alignLeft);
 
 	std::stringstream ss;
 	ss << std::fixed << std::setprecision(3) << (frameTimer * 1000.0f) << "ms (" << lastFPS << " fps)";
+	if (renderOnDemand) {
+		ss << ", " << skippedFrames << " frames skipped";
+	}
 	textOverlay->addText(ss.str(), 5.0f, 25.0f, VulkanTextOverlay::alignLeft);
 
-	textOverlay->addText(deviceProperties.deviceName, 5.0f, 45.0f, VulkanTextOverlay::alignLeft);
+	// the CPU records the next frames while the GPU works on the last ones, it only waits once all frames are in flight
+	ss.str("");
+	ss << std::fixed << std::setprecision(3) << lastCpuFrameTime << "ms cpu, " << lastFrameWaitTime << "ms waiting for the gpu ("
+		<< MAX_FRAMES_IN_FLIGHT << " frames in flight)";
+	textOverlay->addText(ss.str(), 5.0f, 45.0f, VulkanTextOverlay::alignLeft);
+
+	textOverlay->addText(deviceProperties.deviceName, 5.0f, 65.0f, VulkanTextOverlay::alignLeft);
+
+	vk::MemoryStats memoryStats = vulkanDevice->allocator->getStats();
+	ss.str("");
+	ss << std::setprecision(1) << memoryStats.usedBytes / 1048576.0 << " of " << memoryStats.blockBytes / 1048576.0 << " MB in "
+		<< memoryStats.blockCount << " blocks, " << memoryStats.fragmentation() * 100.0f << "% fragmented";
+	textOverlay->addText(ss.str(), 5.0f, 85.0f, VulkanTextOverlay::alignLeft);
+
+	// GPU time per pass over the last frames, to tell whether the traversal or the composition limits the frame rate
+	for (uint32_t pass = 0; pass < profiler->getNumPasses(); pass++) {
+		GpuProfiler::Stats stats = profiler->getStats(pass);
+		ss.str("");
+		ss << std::setprecision(3) << profiler->getName(pass) << ": ";
+		if (stats.samples == 0) {
+			ss << "not measured";
+		} else {
+			ss << stats.min << " min, " << stats.avg << " avg, " << stats.p95 << " p95, " << stats.max << " max ms";
+		}
+		textOverlay->addText(ss.str(), 5.0f, 105.0f + 20.0f * pass, VulkanTextOverlay::alignLeft);
+	}
 
 	textOverlay->endTextUpdate();
 }
 
+void VulkanBase::waitForFrames() {
+	std::array<VkFence, MAX_FRAMES_IN_FLIGHT> fences;
+	for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+		fences[i] = frames[i].fence;
+	}
+	VK_CHECK_RESULT(vkWaitForFences(device, MAX_FRAMES_IN_FLIGHT, fences.data(), VK_TRUE, UINT64_MAX));
+}
+
+void VulkanBase::waitForFrame() {
+	// the command buffers and semaphores of the frame are free again once the frame MAX_FRAMES_IN_FLIGHT before has finished
+	auto tStart = std::chrono::high_resolution_clock::now();
+	VK_CHECK_RESULT(vkWaitForFences(device, 1, &frames[currentFrame].fence, VK_TRUE, UINT64_MAX));
+	frameWaitTime += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - tStart).count();
+
+	if (enableTextOverlay) {
+		profiler->collect(textOverlayPass, currentFrame);
+	}
+}
+
+void VulkanBase::prepareFrame() {
+	Frame& frame = frames[currentFrame];
+	waitForFrame();
+
+	// get next image from swap chain
+	VK_CHECK_RESULT(swapChain.acquireNextImage(frame.presentComplete, &currentBuffer));
+
+	// the image may still be rendered to by an older frame if the swap chain returns the images out of order
+	if (imageFences[currentBuffer] != VK_NULL_HANDLE && imageFences[currentBuffer] != frame.fence) {
+		auto tStart = std::chrono::high_resolution_clock::now();
+		VK_CHECK_RESULT(vkWaitForFences(device, 1, &imageFences[currentBuffer], VK_TRUE, UINT64_MAX));
+		frameWaitTime += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - tStart).count();
+	}
+	imageFences[currentBuffer] = frame.fence;
+
+	VK_CHECK_RESULT(vkResetFences(device, 1, &frame.fence));
+
+	submitInfo.pWaitDstStageMask = &submitPipelineStages;
+	submitInfo.waitSemaphoreCount = 1;
+	submitInfo.pWaitSemaphores = &frame.presentComplete;
+	submitInfo.signalSemaphoreCount = 1;
+	submitInfo.pSignalSemaphores = &frame.renderComplete;
+}
+
 void VulkanBase::submitFrame() {
+	Frame& frame = frames[currentFrame];
 	bool submitTextOverlay = enableTextOverlay && textOverlay->visible;
 
 	if (submitTextOverlay) {
 		// wait for color attachment output to finish before rendering the text overlay
 		VkPipelineStageFlags stageFlags = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-		submitInfo.pWaitDstStageMask = &stageFlags;
-
-		// set semaphores
-		// wait for render complete semaphore
-		submitInfo.waitSemaphoreCount = 1;
-		submitInfo.pWaitSemaphores = &semaphores.renderComplete;
-		// signal ready with text overlay complete semaphpre
-		submitInfo.signalSemaphoreCount = 1;
-		submitInfo.pSignalSemaphores = &semaphores.textOverlayComplete;
-
-		// submit current text overlay command buffer
-		submitInfo.commandBufferCount = 1;
-		submitInfo.pCommandBuffers = &textOverlay->cmdBuffers[currentBuffer];
-		VK_CHECK_RESULT(vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE));
-
-		// reset stage mask
-		submitInfo.pWaitDstStageMask = &submitPipelineStages;
-		// reset wait and signal semaphores for rendering next frame
-		// wait for swap chain presentation to finish
-		submitInfo.waitSemaphoreCount = 1;
-		submitInfo.pWaitSemaphores = &semaphores.presentComplete;
-		// signal ready with offscreen semaphore
-		submitInfo.signalSemaphoreCount = 1;
-		submitInfo.pSignalSemaphores = &semaphores.renderComplete;
-	}
-
-	VK_CHECK_RESULT(swapChain.queuePresent(queue, currentBuffer, submitTextOverlay ? semaphores.textOverlayComplete : semaphores.renderComplete));
+		VkSubmitInfo textOverlaySubmitInfo = vkTools::initializers::submitInfo();
+		textOverlaySubmitInfo.pWaitDstStageMask = &stageFlags;
+		textOverlaySubmitInfo.waitSemaphoreCount = 1;
+		textOverlaySubmitInfo.pWaitSemaphores = &frame.renderComplete;
+		textOverlaySubmitInfo.signalSemaphoreCount = 1;
+		textOverlaySubmitInfo.pSignalSemaphores = &frame.textOverlayComplete;
+
+		// submit current text overlay command buffer between the timestamps of the profiler
+		std::array<VkCommandBuffer, 3> commandBuffers = {
+			profiler->begin(textOverlayPass, currentFrame),
+			textOverlay->cmdBuffers[currentBuffer],
+			profiler->end(textOverlayPass, currentFrame)
+		};
+		textOverlaySubmitInfo.commandBufferCount = uint32_t(commandBuffers.size());
+		textOverlaySubmitInfo.pCommandBuffers = commandBuffers.data();
+		VK_CHECK_RESULT(vkQueueSubmit(queue, 1, &textOverlaySubmitInfo, VK_NULL_HANDLE));
+	}
 
-	VK_CHECK_RESULT(vkQueueWaitIdle(queue));
+	// an empty submission signals the fence once everything submitted for the frame before has finished, the CPU
+	// continues with the next frame instead of waiting for the queue to become idle
+	VK_CHECK_RESULT(vkQueueSubmit(queue, 0, nullptr, frame.fence));
+
+	VK_CHECK_RESULT(swapChain.queuePresent(queue, currentBuffer, submitTextOverlay ? frame.textOverlayComplete : frame.renderComplete));
+
+	currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
 }
 
 VulkanBase::VulkanBase(bool enableValidation, PFN_GetEnabledFeatures enabledFeaturesFn) {
@@ -294,14 +379,19 @@ VulkanBase::~VulkanBase() {
 
 	vkDestroyCommandPool(device, cmdPool, nullptr);
 
-	vkDestroySemaphore(device, semaphores.presentComplete, nullptr);
-	vkDestroySemaphore(device, semaphores.renderComplete, nullptr);
-	vkDestroySemaphore(device, semaphores.textOverlayComplete, nullptr);
+	for (Frame& frame : frames) {
+		vkDestroySemaphore(device, frame.presentComplete, nullptr);
+		vkDestroySemaphore(device, frame.renderComplete, nullptr);
+		vkDestroySemaphore(device, frame.textOverlayComplete, nullptr);
+		vkDestroyFence(device, frame.fence, nullptr);
+	}
 
 	if (enableTextOverlay) {
 		delete textOverlay;
 	}
 
+	delete profiler;
+
 	delete vulkanDevice;
 
 	if (enableValidation) {
@@ -339,7 +429,8 @@ void VulkanBase::initVulkan(bool enableValidation) {
 
 	// Vulkan logical device
 	vulkanDevice = new vk::VulkanDevice(physicalDevice);
-	VK_CHECK_RESULT(vulkanDevice->createLogicalDevice(enabledFeatures));
+	// the octree is streamed through a dedicated transfer queue where the device has one
+	VK_CHECK_RESULT(vulkanDevice->createLogicalDevice(enabledFeatures, true, VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT));
 	device = vulkanDevice->logicalDevice;
 
 	vkGetPhysicalDeviceProperties(physicalDevice, &deviceProperties);
@@ -355,22 +446,24 @@ void VulkanBase::initVulkan(bool enableValidation) {
 
 	swapChain.connect(instance, physicalDevice, device);
 
-	// create synchronization objects
+	// create synchronization objects for every frame in flight
 	VkSemaphoreCreateInfo semaphoreCreateInfo = vkTools::initializers::semaphoreCreateInfo();
-	// ensures that the image presentation is finished before new commands are submitted to the queue
-	VK_CHECK_RESULT(vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &semaphores.presentComplete));
-	// ensures that all commands are finished before presenting the image
-	VK_CHECK_RESULT(vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &semaphores.renderComplete));
-	// ensures that all commands are finished before presenting the text overlay
-	VK_CHECK_RESULT(vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &semaphores.textOverlayComplete));
-
-	// basic submit info structure
+	// signaled, so that the first use of every frame does not wait
+	VkFenceCreateInfo fenceCreateInfo = vkTools::initializers::fenceCreateInfo(VK_FENCE_CREATE_SIGNALED_BIT);
+	for (Frame& frame : frames) {
+		// ensures that the image presentation is finished before new commands are submitted to the queue
+		VK_CHECK_RESULT(vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &frame.presentComplete));
+		// ensures that all commands are finished before presenting the image
+		VK_CHECK_RESULT(vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &frame.renderComplete));
+		// ensures that all commands are finished before presenting the text overlay
+		VK_CHECK_RESULT(vkCreateSemaphore(device, &semaphoreCreateInfo, nullptr, &frame.textOverlayComplete));
+		// ensures that the resources of the frame are not reused before its commands are finished
+		VK_CHECK_RESULT(vkCreateFence(device, &fenceCreateInfo, nullptr, &frame.fence));
+	}
+
+	// basic submit info structure, the semaphores are set per frame by prepareFrame()
 	submitInfo = vkTools::initializers::submitInfo();
 	submitInfo.pWaitDstStageMask = &submitPipelineStages;
-	submitInfo.waitSemaphoreCount = 1;
-	submitInfo.pWaitSemaphores = &semaphores.presentComplete;
-	submitInfo.signalSemaphoreCount = 1;
-	submitInfo.pSignalSemaphores = &semaphores.renderComplete;
 }
 
 #if defined(_WIN32)
@@ -422,8 +515,12 @@ void VulkanBase::handleKeyEvent(GLFWwindow* window, int key, int scancode, int a
 		case GLFW_KEY_F1:
 			if (app->enableTextOverlay) {
 				app->textOverlay->visible = !app->textOverlay->visible;
+				app->viewUpdated = true;
 			}
 			break;
+		default:
+			app->keyPressed(key);
+			break;
 		}
 	} else if (action == GLFW_RELEASE) {
 		switch (key) {
@@ -628,6 +725,9 @@ void VulkanBase::windowResize() {
 	}
 	prepared = false;
 
+	// nothing may use the swap chain and the command buffers anymore before they are recreated
+	vkDeviceWaitIdle(device);
+
 	// recreate swap chain
 	width = destWidth;
 	height = destHeight;
@@ -661,6 +761,7 @@ void VulkanBase::windowResize() {
 	}
 
 	camera.updateAspectRatio((float)width / (float)height);
+	viewUpdated = true;
 
 	prepared = true;
 }
@@ -671,4 +772,5 @@ void VulkanBase::initSwapchain() {
 
 void VulkanBase::setupSwapChain() {
 	swapChain.create(&width, &height, enableVSync);
+	imageFences.assign(swapChain.imageCount, VK_NULL_HANDLE);
 }
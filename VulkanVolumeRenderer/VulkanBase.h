@@ -27,11 +27,15 @@
 #include "vulkanTextureLoader.hpp"
 #include "vulkantextoverlay.hpp"
 #include "Camera.hpp"
+#include "GpuProfiler.h"
 #include "utility.hpp"
 
 // function pointer for getting physical device features to be enabled
 typedef VkPhysicalDeviceFeatures(*PFN_GetEnabledFeatures)();
 
+// frames the CPU may record and submit before it waits for the GPU to finish the oldest one
+const uint32_t MAX_FRAMES_IN_FLIGHT = 2;
+
 class VulkanBase {
 private:
 	bool enableValidation = false;
@@ -40,7 +44,6 @@ private:
 	// fps timer (1 sec interval)
 	float fpsTimer = 0.0f; 
 	double tDelta = 0.0;
-	bool viewUpdated = false;
 	uint32_t destWidth;
 	uint32_t destHeight;
 	bool resizing = false;
@@ -50,9 +53,21 @@ private:
 	void windowResize();
 
 protected:
+	// set by input that changes the window contents outside of the camera, e.g. resizing or hiding the text overlay
+	bool viewUpdated = true;
+	// render() sets frameSkipped if the frame would look like the last one, the loop then sleeps until input arrives
+	// or idleTimeout seconds have passed (< 0: only input)
+	bool frameSkipped = false;
+	double idleTimeout = -1.0;
+	uint64_t skippedFrames = 0;
 	float frameTimer = 1.0f;
 	uint32_t frameCounter = 0;
 	uint32_t lastFPS = 0;
+	// time spent in prepareFrame() waiting for the GPU to release the frame resources, summed up and averaged per
+	// fps interval; the rest of the frame time the CPU works in parallel to the GPU
+	double frameWaitTime = 0.0;
+	double lastFrameWaitTime = 0.0;
+	double lastCpuFrameTime = 0.0;
 	VkInstance instance;
 	VkPhysicalDevice physicalDevice;
 	VkPhysicalDeviceProperties deviceProperties;
@@ -70,7 +85,8 @@ protected:
 	VkPipelineStageFlags submitPipelineStages = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT; 
 	// contains command buffers and semaphores to be presented to the queue
 	VkSubmitInfo submitInfo;
-	// command buffers used for rendering
+	// command buffers used for rendering, MAX_FRAMES_IN_FLIGHT per swap chain image so that derived classes can record
+	// them for each copy of a per frame resource (e.g. a render target): drawCmdBuffers[copy * swapChain.imageCount + image]
 	std::vector<VkCommandBuffer> drawCmdBuffers;
 	// global render pass for frame buffer writes
 	VkRenderPass renderPass;
@@ -83,12 +99,25 @@ protected:
 	VkPipelineCache pipelineCache;
 	VulkanSwapChain swapChain;
 
-	// synchronization semaphores
-	struct {
+	// synchronization objects of every frame in flight
+	struct Frame {
 		VkSemaphore presentComplete; // swap chain image presentation
 		VkSemaphore renderComplete; // command buffer submission and execution
 		VkSemaphore textOverlayComplete; // text overlay submission and execution
-	} semaphores;
+		VkFence fence; // signaled once all commands submitted for the frame have finished
+	};
+	std::array<Frame, MAX_FRAMES_IN_FLIGHT> frames;
+	// frame in flight that is currently recorded
+	uint32_t currentFrame = 0;
+	// fence of the frame that last rendered into each swap chain image, the image may be acquired again before it has finished
+	std::vector<VkFence> imageFences;
+
+	// waits until all frames in flight have finished, e.g. before resources used by all of them are changed
+	void waitForFrames();
+
+	// GPU time of the passes, a slot per frame in flight; derived classes add their passes, the text overlay is measured here
+	GpuProfiler *profiler = nullptr;
+	uint32_t textOverlayPass = 0;
 
 	vkTools::VulkanTextureLoader *textureLoader = nullptr;
 
@@ -108,6 +137,9 @@ public:
 
 	bool paused = false;
 
+	// only render frames that differ from the last one instead of rendering continuously
+	bool renderOnDemand = true;
+
 	bool enableTextOverlay = false;
 	VulkanTextOverlay *textOverlay;
 
@@ -149,6 +181,9 @@ public:
 	// virtual render function (override in derived class)
 	virtual void render(double tDelta) = 0;
 
+	// called for keys that are not handled by the base class (override in derived class)
+	virtual void keyPressed(int key) {}
+
 	// creates a new command pool object storing command buffers
 	void createCommandPool();
 	// setup default depth and stencil views
@@ -187,7 +222,15 @@ public:
 
 	void updateTextOverlay();
 
-	// submit the frames workload and if enabled, the text overlay
+	// waits until the resources of the current frame in flight are free; work of the frame that does not render to the
+	// swap chain (e.g. an asynchronous compute pass) can be submitted before prepareFrame() waits for the next image
+	void waitForFrame();
+
+	// waits for the frame, acquires the next swap chain image and sets up submitInfo to wait for it; everything
+	// recorded for the frame has to be submitted before submitFrame() is called
+	void prepareFrame();
+
+	// submit the frames workload and if enabled, the text overlay, then present and advance to the next frame in flight
 	void submitFrame();
 };
 
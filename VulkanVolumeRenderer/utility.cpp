@@ -59,4 +59,15 @@ namespace util {
 	const std::string getAssetPath() {
 		return "./../data/";
 	}
-}
\ No newline at end of file
+
+	float halton(uint32_t index, uint32_t base) {
+		float result = 0.0f;
+		float fraction = 1.0f;
+		while (index > 0) {
+			fraction /= base;
+			result += fraction * (index % base);
+			index /= base;
+		}
+		return result;
+	}
+}
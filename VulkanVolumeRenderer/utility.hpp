@@ -11,4 +11,7 @@ namespace util {
 	VkPipelineShaderStageCreateInfo loadShader(VkDevice device, std::string fileName, VkShaderStageFlagBits stage, std::vector<VkShaderModule> *cleanupList);
 
 	const std::string getAssetPath();
+
+	// element index of the Halton sequence in base, low discrepancy in [0, 1)
+	float halton(uint32_t index, uint32_t base);
 }
\ No newline at end of file
@@ -22,6 +22,8 @@ namespace vkTools {
 		VkImage image;
 		VkImageLayout imageLayout;
 		VkDeviceMemory deviceMemory;
+		/** @brief Sub-allocated range of deviceMemory, empty if the texture owns deviceMemory */
+		vk::Allocation allocation;
 		VkImageView view;
 		uint32_t width, height;
 		uint32_t mipLevels;
@@ -176,13 +178,8 @@ namespace vkTools {
 				}
 				VK_CHECK_RESULT(vkCreateImage(vulkanDevice->logicalDevice, &imageCreateInfo, nullptr, &texture->image));
 
-				vkGetImageMemoryRequirements(vulkanDevice->logicalDevice, texture->image, &memReqs);
-
-				memAllocInfo.allocationSize = memReqs.size;
-
-				memAllocInfo.memoryTypeIndex = vulkanDevice->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-				VK_CHECK_RESULT(vkAllocateMemory(vulkanDevice->logicalDevice, &memAllocInfo, nullptr, &texture->deviceMemory));
-				VK_CHECK_RESULT(vkBindImageMemory(vulkanDevice->logicalDevice, texture->image, texture->deviceMemory, 0));
+				VK_CHECK_RESULT(vulkanDevice->allocateImageMemory(texture->image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &texture->allocation));
+				texture->deviceMemory = texture->allocation.memory;
 
 				VkImageSubresourceRange subresourceRange = {};
 				subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -469,13 +466,8 @@ namespace vkTools {
 
 			VK_CHECK_RESULT(vkCreateImage(vulkanDevice->logicalDevice, &imageCreateInfo, nullptr, &texture->image));
 
-			vkGetImageMemoryRequirements(vulkanDevice->logicalDevice, texture->image, &memReqs);
-
-			memAllocInfo.allocationSize = memReqs.size;
-			memAllocInfo.memoryTypeIndex = vulkanDevice->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-
-			VK_CHECK_RESULT(vkAllocateMemory(vulkanDevice->logicalDevice, &memAllocInfo, nullptr, &texture->deviceMemory));
-			VK_CHECK_RESULT(vkBindImageMemory(vulkanDevice->logicalDevice, texture->image, texture->deviceMemory, 0));
+			VK_CHECK_RESULT(vulkanDevice->allocateImageMemory(texture->image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &texture->allocation));
+			texture->deviceMemory = texture->allocation.memory;
 
 			VkCommandBufferBeginInfo cmdBufInfo = vkTools::initializers::commandBufferBeginInfo();
 			VK_CHECK_RESULT(vkBeginCommandBuffer(cmdBuffer, &cmdBufInfo));
@@ -660,13 +652,8 @@ namespace vkTools {
 
 			VK_CHECK_RESULT(vkCreateImage(vulkanDevice->logicalDevice, &imageCreateInfo, nullptr, &texture->image));
 
-			vkGetImageMemoryRequirements(vulkanDevice->logicalDevice, texture->image, &memReqs);
-
-			memAllocInfo.allocationSize = memReqs.size;
-			memAllocInfo.memoryTypeIndex = vulkanDevice->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-
-			VK_CHECK_RESULT(vkAllocateMemory(vulkanDevice->logicalDevice, &memAllocInfo, nullptr, &texture->deviceMemory));
-			VK_CHECK_RESULT(vkBindImageMemory(vulkanDevice->logicalDevice, texture->image, texture->deviceMemory, 0));
+			VK_CHECK_RESULT(vulkanDevice->allocateImageMemory(texture->image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &texture->allocation));
+			texture->deviceMemory = texture->allocation.memory;
 
 			VkCommandBufferBeginInfo cmdBufInfo = vkTools::initializers::commandBufferBeginInfo();
 			VK_CHECK_RESULT(vkBeginCommandBuffer(cmdBuffer, &cmdBufInfo));
@@ -842,13 +829,8 @@ namespace vkTools {
 			}
 			VK_CHECK_RESULT(vkCreateImage(vulkanDevice->logicalDevice, &imageCreateInfo, nullptr, &texture->image));
 
-			vkGetImageMemoryRequirements(vulkanDevice->logicalDevice, texture->image, &memReqs);
-
-			memAllocInfo.allocationSize = memReqs.size;
-
-			memAllocInfo.memoryTypeIndex = vulkanDevice->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-			VK_CHECK_RESULT(vkAllocateMemory(vulkanDevice->logicalDevice, &memAllocInfo, nullptr, &texture->deviceMemory));
-			VK_CHECK_RESULT(vkBindImageMemory(vulkanDevice->logicalDevice, texture->image, texture->deviceMemory, 0));
+			VK_CHECK_RESULT(vulkanDevice->allocateImageMemory(texture->image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &texture->allocation));
+			texture->deviceMemory = texture->allocation.memory;
 
 			VkImageSubresourceRange subresourceRange = {};
 			subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -951,7 +933,11 @@ namespace vkTools {
 			vkDestroyImageView(vulkanDevice->logicalDevice, texture.view, nullptr);
 			vkDestroyImage(vulkanDevice->logicalDevice, texture.image, nullptr);
 			vkDestroySampler(vulkanDevice->logicalDevice, texture.sampler, nullptr);
-			vkFreeMemory(vulkanDevice->logicalDevice, texture.deviceMemory, nullptr);
+			if (texture.allocation.block) {
+				vulkanDevice->allocator->free(texture.allocation);
+			} else {
+				vkFreeMemory(vulkanDevice->logicalDevice, texture.deviceMemory, nullptr);
+			}
 		}
 	};
 };
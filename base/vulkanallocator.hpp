@@ -0,0 +1,358 @@
+/*
+* Vulkan device memory allocator
+*
+* Sub-allocates buffers and images from large device memory blocks
+*
+* This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include <assert.h>
+#include "vulkan/vulkan.h"
+
+namespace vk {
+	struct MemoryBlock;
+
+	/**
+	* @brief Range of a device memory block handed out by the MemoryAllocator
+	*/
+	struct Allocation {
+		/** @brief Memory of the block the allocation lives in, resources are bound at offset */
+		VkDeviceMemory memory = VK_NULL_HANDLE;
+		VkDeviceSize offset = 0;
+		VkDeviceSize size = 0;
+		/** @brief Host address of offset if the block is host visible (blocks stay mapped), nullptr otherwise */
+		void* mapped = nullptr;
+		/** @brief Owning block, only used by the allocator */
+		MemoryBlock* block = nullptr;
+	};
+
+	/**
+	* @brief Usage and fragmentation of the blocks of one memory type (or of all memory types)
+	*/
+	struct MemoryStats {
+		uint32_t blockCount = 0;
+		uint32_t allocationCount = 0;
+		/** @brief Device memory allocated by the blocks */
+		VkDeviceSize blockBytes = 0;
+		/** @brief Bytes handed out to live allocations, including alignment padding */
+		VkDeviceSize usedBytes = 0;
+		uint32_t freeRangeCount = 0;
+		VkDeviceSize largestFreeRange = 0;
+
+		/**
+		* @return Share of the free memory that is not part of the largest free range, 0 if all free memory is contiguous
+		*/
+		float fragmentation() const {
+			VkDeviceSize freeBytes = blockBytes - usedBytes;
+			return freeBytes > 0 ? 1.0f - float(largestFreeRange) / float(freeBytes) : 0.0f;
+		}
+
+		void add(const MemoryStats& other) {
+			blockCount += other.blockCount;
+			allocationCount += other.allocationCount;
+			blockBytes += other.blockBytes;
+			usedBytes += other.usedBytes;
+			freeRangeCount += other.freeRangeCount;
+			largestFreeRange = std::max(largestFreeRange, other.largestFreeRange);
+		}
+	};
+
+	/**
+	* @brief Single vkAllocateMemory call that is split into allocations
+	*/
+	struct MemoryBlock {
+		VkDeviceMemory memory = VK_NULL_HANDLE;
+		VkDeviceSize size = 0;
+		uint32_t memoryTypeIndex = 0;
+		/** @brief Pool index, memory type and tiling of the resources in the block */
+		uint32_t pool = 0;
+		/** @brief Dedicated blocks hold exactly one large allocation and are released with it */
+		bool dedicated = false;
+		void* mapped = nullptr;
+		uint32_t allocationCount = 0;
+		VkDeviceSize usedBytes = 0;
+		/** @brief Free ranges ordered by offset, offset -> size */
+		std::map<VkDeviceSize, VkDeviceSize> freeRanges;
+	};
+
+	/**
+	* @brief Block based device memory allocator with one pool of blocks per memory type
+	*
+	* Linear resources (buffers, linear images) and optimal tiling images are kept in separate pools, so
+	* bufferImageGranularity never has to be respected between neighbouring allocations. Host visible
+	* blocks are mapped once on creation, so allocations in the same block can be mapped independently.
+	*/
+	class MemoryAllocator {
+	private:
+		VkDevice device;
+		VkPhysicalDeviceMemoryProperties memoryProperties;
+		VkDeviceSize nonCoherentAtomSize;
+		uint32_t maxAllocationCount;
+		VkDeviceSize blockSize;
+		/** @brief Blocks of pool memoryTypeIndex * 2 + (optimal tiling ? 1 : 0) */
+		std::vector<std::vector<std::unique_ptr<MemoryBlock>>> pools;
+		uint32_t deviceAllocationCount = 0;
+		std::mutex mutex;
+
+		static VkDeviceSize alignUp(VkDeviceSize value, VkDeviceSize alignment) {
+			return (value + alignment - 1) / alignment * alignment;
+		}
+
+		VkResult createBlock(uint32_t pool, uint32_t memoryTypeIndex, VkDeviceSize size, bool dedicated, MemoryBlock** block) {
+			if (deviceAllocationCount >= maxAllocationCount) {
+				return VK_ERROR_TOO_MANY_OBJECTS;
+			}
+			std::unique_ptr<MemoryBlock> newBlock(new MemoryBlock());
+			VkMemoryAllocateInfo memAlloc = {};
+			memAlloc.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+			memAlloc.allocationSize = size;
+			memAlloc.memoryTypeIndex = memoryTypeIndex;
+			VkResult result = vkAllocateMemory(device, &memAlloc, nullptr, &newBlock->memory);
+			if (result != VK_SUCCESS) {
+				return result;
+			}
+			if (memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+				result = vkMapMemory(device, newBlock->memory, 0, VK_WHOLE_SIZE, 0, &newBlock->mapped);
+				if (result != VK_SUCCESS) {
+					vkFreeMemory(device, newBlock->memory, nullptr);
+					return result;
+				}
+			}
+			deviceAllocationCount++;
+			newBlock->size = size;
+			newBlock->memoryTypeIndex = memoryTypeIndex;
+			newBlock->pool = pool;
+			newBlock->dedicated = dedicated;
+			newBlock->freeRanges[0] = size;
+			*block = newBlock.get();
+			pools[pool].push_back(std::move(newBlock));
+			return VK_SUCCESS;
+		}
+
+		void destroyBlock(MemoryBlock* block) {
+			std::vector<std::unique_ptr<MemoryBlock>>& blocks = pools[block->pool];
+			if (block->mapped) {
+				vkUnmapMemory(device, block->memory);
+			}
+			vkFreeMemory(device, block->memory, nullptr);
+			deviceAllocationCount--;
+			blocks.erase(std::find_if(blocks.begin(), blocks.end(), [block](const std::unique_ptr<MemoryBlock>& b) { return b.get() == block; }));
+		}
+
+		/**
+		* Best fit in the free ranges of a block
+		*
+		* @return True if the allocation fits into the block
+		*/
+		bool allocateFromBlock(MemoryBlock* block, VkDeviceSize size, VkDeviceSize alignment, Allocation* allocation) {
+			auto best = block->freeRanges.end();
+			for (auto range = block->freeRanges.begin(); range != block->freeRanges.end(); range++) {
+				VkDeviceSize offset = alignUp(range->first, alignment);
+				if (offset + size <= range->first + range->second && (best == block->freeRanges.end() || range->second < best->second)) {
+					best = range;
+				}
+			}
+			if (best == block->freeRanges.end()) {
+				return false;
+			}
+
+			VkDeviceSize rangeOffset = best->first;
+			VkDeviceSize rangeEnd = best->first + best->second;
+			VkDeviceSize offset = alignUp(rangeOffset, alignment);
+			block->freeRanges.erase(best);
+			// the alignment padding in front stays free, it can still take allocations with a smaller alignment
+			if (offset > rangeOffset) {
+				block->freeRanges[rangeOffset] = offset - rangeOffset;
+			}
+			if (offset + size < rangeEnd) {
+				block->freeRanges[offset + size] = rangeEnd - (offset + size);
+			}
+			block->allocationCount++;
+			block->usedBytes += size;
+
+			allocation->memory = block->memory;
+			allocation->offset = offset;
+			allocation->size = size;
+			allocation->mapped = block->mapped ? static_cast<uint8_t*>(block->mapped) + offset : nullptr;
+			allocation->block = block;
+			return true;
+		}
+
+		MemoryStats blockStats(const MemoryBlock* block) const {
+			MemoryStats stats;
+			stats.blockCount = 1;
+			stats.allocationCount = block->allocationCount;
+			stats.blockBytes = block->size;
+			stats.usedBytes = block->usedBytes;
+			stats.freeRangeCount = static_cast<uint32_t>(block->freeRanges.size());
+			for (auto& range : block->freeRanges) {
+				stats.largestFreeRange = std::max(stats.largestFreeRange, range.second);
+			}
+			return stats;
+		}
+
+	public:
+		/**
+		* Default constructor
+		*
+		* @param device Logical device the memory is allocated from
+		* @param physicalDevice Physical device of the logical device, used to query memory types and limits
+		* @param blockSize (Optional) Size of the device memory blocks, larger requests get a block of their own
+		*/
+		MemoryAllocator(VkDevice device, VkPhysicalDevice physicalDevice, VkDeviceSize blockSize = 64 * 1024 * 1024) {
+			this->device = device;
+			this->blockSize = blockSize;
+			vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memoryProperties);
+			VkPhysicalDeviceProperties properties;
+			vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+			nonCoherentAtomSize = std::max<VkDeviceSize>(properties.limits.nonCoherentAtomSize, 1);
+			maxAllocationCount = properties.limits.maxMemoryAllocationCount;
+			pools.resize(memoryProperties.memoryTypeCount * 2);
+		}
+
+		/**
+		* Default destructor
+		*
+		* @note Frees all blocks, resources bound to them have to be destroyed before
+		*/
+		~MemoryAllocator() {
+			for (auto& blocks : pools) {
+				while (!blocks.empty()) {
+					destroyBlock(blocks.back().get());
+				}
+			}
+		}
+
+		/**
+		* Get the index of a memory type that has all the requested property bits set
+		*
+		* @return Index of the requested memory type
+		*
+		* @throw Throws an exception if no memory type could be found that supports the requested properties
+		*/
+		uint32_t getMemoryType(uint32_t typeBits, VkMemoryPropertyFlags properties) const {
+			for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
+				if ((typeBits & (1u << i)) && (memoryProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+					return i;
+				}
+			}
+			throw std::runtime_error("Could not find a matching memory type");
+		}
+
+		/**
+		* Sub-allocate memory for a resource
+		*
+		* @param memReqs Memory requirements of the resource (from vkGet*MemoryRequirements)
+		* @param memoryPropertyFlags Memory properties the memory type has to support
+		* @param optimalTiling Set to true for images with optimal tiling, false for buffers and linear images
+		* @param allocation Pointer to the allocation, the resource has to be bound to allocation->memory at allocation->offset
+		*
+		* @return VK_SUCCESS if the memory could be allocated
+		*/
+		VkResult allocate(VkMemoryRequirements memReqs, VkMemoryPropertyFlags memoryPropertyFlags, bool optimalTiling, Allocation* allocation) {
+			std::lock_guard<std::mutex> lock(mutex);
+			uint32_t memoryTypeIndex = getMemoryType(memReqs.memoryTypeBits, memoryPropertyFlags);
+			uint32_t pool = memoryTypeIndex * 2 + (optimalTiling ? 1 : 0);
+			VkDeviceSize alignment = std::max<VkDeviceSize>(memReqs.alignment, 1);
+			VkDeviceSize size = memReqs.size;
+			VkMemoryPropertyFlags typeFlags = memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags;
+			if ((typeFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) && !(typeFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+				// flushed ranges have to be atom aligned, so no two allocations may share an atom
+				alignment = alignUp(alignment, nonCoherentAtomSize);
+				size = alignUp(size, nonCoherentAtomSize);
+			}
+
+			MemoryBlock* block = nullptr;
+			if (size > blockSize / 2) {
+				VkResult result = createBlock(pool, memoryTypeIndex, size, true, &block);
+				if (result != VK_SUCCESS) {
+					return result;
+				}
+				allocateFromBlock(block, size, alignment, allocation);
+				return VK_SUCCESS;
+			}
+			for (auto& candidate : pools[pool]) {
+				if (!candidate->dedicated && allocateFromBlock(candidate.get(), size, alignment, allocation)) {
+					return VK_SUCCESS;
+				}
+			}
+			VkResult result = createBlock(pool, memoryTypeIndex, blockSize, false, &block);
+			if (result != VK_SUCCESS) {
+				return result;
+			}
+			allocateFromBlock(block, size, alignment, allocation);
+			return VK_SUCCESS;
+		}
+
+		/**
+		* Return an allocation to its block
+		*
+		* @note Empty blocks are released unless they are the last block of their pool
+		*/
+		void free(Allocation& allocation) {
+			if (!allocation.block) {
+				return;
+			}
+			std::lock_guard<std::mutex> lock(mutex);
+			MemoryBlock* block = allocation.block;
+			VkDeviceSize offset = allocation.offset;
+			VkDeviceSize size = allocation.size;
+			block->allocationCount--;
+			block->usedBytes -= size;
+
+			// merge with the free neighbours
+			auto next = block->freeRanges.lower_bound(offset);
+			if (next != block->freeRanges.end() && next->first == offset + size) {
+				size += next->second;
+				next = block->freeRanges.erase(next);
+			}
+			if (next != block->freeRanges.begin()) {
+				auto prev = std::prev(next);
+				if (prev->first + prev->second == offset) {
+					offset = prev->first;
+					size += prev->second;
+					block->freeRanges.erase(prev);
+				}
+			}
+			block->freeRanges[offset] = size;
+
+			if (block->allocationCount == 0 && (block->dedicated || pools[block->pool].size() > 1)) {
+				destroyBlock(block);
+			}
+			allocation = Allocation();
+		}
+
+		/**
+		* @return Statistics of the blocks of one memory type
+		*/
+		MemoryStats getStats(uint32_t memoryTypeIndex) {
+			std::lock_guard<std::mutex> lock(mutex);
+			MemoryStats stats;
+			for (uint32_t pool = memoryTypeIndex * 2; pool < memoryTypeIndex * 2 + 2; pool++) {
+				for (auto& block : pools[pool]) {
+					stats.add(blockStats(block.get()));
+				}
+			}
+			return stats;
+		}
+
+		/**
+		* @return Statistics of all blocks
+		*/
+		MemoryStats getStats() {
+			MemoryStats stats;
+			for (uint32_t i = 0; i < memoryProperties.memoryTypeCount; i++) {
+				stats.add(getStats(i));
+			}
+			return stats;
+		}
+	};
+}
@@ -14,6 +14,7 @@
 
 #include "vulkan/vulkan.h"
 #include "vulkantools.h"
+#include "vulkanallocator.hpp"
 
 namespace vk {
 	/**
@@ -28,6 +29,10 @@ namespace vk {
 		VkDeviceSize size = 0;
 		VkDeviceSize alignment = 0;
 		void* mapped = nullptr;
+		/** @brief Allocator the memory was sub-allocated from, nullptr if the buffer owns its memory */
+		vk::MemoryAllocator* allocator = nullptr;
+		/** @brief Range of memory backing the buffer if it was sub-allocated */
+		vk::Allocation allocation;
 
 		/** @brief Usage flags to be filled by external source at buffer creation (to query at some later point) */
 		VkBufferUsageFlags usageFlags;
@@ -43,7 +48,12 @@ namespace vk {
 		* @return VkResult of the buffer mapping call
 		*/
 		VkResult map(VkDeviceSize size = VK_WHOLE_SIZE, VkDeviceSize offset = 0) {
-			return vkMapMemory(device, memory, offset, size, 0, &mapped);
+			if (allocation.mapped) {
+				// Host visible blocks of the allocator stay mapped
+				mapped = static_cast<uint8_t*>(allocation.mapped) + offset;
+				return VK_SUCCESS;
+			}
+			return vkMapMemory(device, memory, allocation.offset + offset, size, 0, &mapped);
 		}
 
 		/**
@@ -53,7 +63,9 @@ namespace vk {
 		*/
 		void unmap() {
 			if (mapped) {
-				vkUnmapMemory(device, memory);
+				if (!allocation.mapped) {
+					vkUnmapMemory(device, memory);
+				}
 				mapped = nullptr;
 			}
 		}
@@ -66,7 +78,7 @@ namespace vk {
 		* @return VkResult of the bindBufferMemory call
 		*/
 		VkResult bind(VkDeviceSize offset = 0) {
-			return vkBindBufferMemory(device, buffer, memory, offset);
+			return vkBindBufferMemory(device, buffer, memory, allocation.offset + offset);
 		}
 
 		/**
@@ -108,7 +120,7 @@ namespace vk {
 			VkMappedMemoryRange mappedRange = {};
 			mappedRange.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
 			mappedRange.memory = memory;
-			mappedRange.offset = offset;
+			mappedRange.offset = allocation.offset + offset;
 			mappedRange.size = size;
 			return vkFlushMappedMemoryRanges(device, 1, &mappedRange);
 		}
@@ -127,7 +139,7 @@ namespace vk {
 			VkMappedMemoryRange mappedRange = {};
 			mappedRange.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
 			mappedRange.memory = memory;
-			mappedRange.offset = offset;
+			mappedRange.offset = allocation.offset + offset;
 			mappedRange.size = size;
 			return vkInvalidateMappedMemoryRanges(device, 1, &mappedRange);
 		}
@@ -139,7 +151,9 @@ namespace vk {
 			if (buffer) {
 				vkDestroyBuffer(device, buffer, nullptr);
 			}
-			if (memory) {
+			if (allocator) {
+				allocator->free(allocation);
+			} else if (memory) {
 				vkFreeMemory(device, memory, nullptr);
 			}
 		}
@@ -10,10 +10,13 @@
 
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <exception>
 #include <assert.h>
 #include "vulkan/vulkan.h"
 #include "vulkantools.h"
+#include "vulkanallocator.hpp"
 #include "vulkanbuffer.hpp"
 
 namespace vk {
@@ -34,6 +37,9 @@ namespace vk {
 		/** @brief Default command pool for the graphics queue family index */
 		VkCommandPool commandPool = VK_NULL_HANDLE;
 
+		/** @brief Sub-allocates the memory of buffers and images, created with the logical device */
+		vk::MemoryAllocator *allocator = nullptr;
+
 		/** @brief Set to true when the debug marker extension is detected */
 		bool enableDebugMarkers = false;
 
@@ -44,6 +50,9 @@ namespace vk {
 			uint32_t transfer;
 		} queueFamilyIndices;
 
+		/** @brief Index of the compute queue within its family, a second queue of the graphics family if there is no dedicated compute family */
+		uint32_t computeQueueIndex = 0;
+
 		/**
 		* Default constructor
 		*
@@ -77,6 +86,9 @@ namespace vk {
 			if (commandPool) {
 				vkDestroyCommandPool(logicalDevice, commandPool, nullptr);
 			}
+			if (allocator) {
+				delete allocator;
+			}
 			if (logicalDevice) {
 				vkDestroyDevice(logicalDevice, nullptr);
 			}
@@ -177,6 +189,7 @@ namespace vk {
 			// Note that the indices may overlap depending on the implementation
 
 			const float defaultQueuePriority(0.0f);
+			const std::array<float, 2> sharedQueuePriorities = { 0.0f, 0.0f };
 
 			// Graphics queue
 			if (requestedQueueTypes & VK_QUEUE_GRAPHICS_BIT) {
@@ -202,6 +215,11 @@ namespace vk {
 					queueInfo.queueCount = 1;
 					queueInfo.pQueuePriorities = &defaultQueuePriority;
 					queueCreateInfos.push_back(queueInfo);
+				} else if ((requestedQueueTypes & VK_QUEUE_GRAPHICS_BIT) && queueFamilyProperties[queueFamilyIndices.compute].queueCount > 1) {
+					// Without a dedicated family a second queue of the graphics family still lets compute work run asynchronously to the graphics queue
+					queueCreateInfos.back().queueCount = 2;
+					queueCreateInfos.back().pQueuePriorities = sharedQueuePriorities.data();
+					computeQueueIndex = 1;
 				}
 			} else {
 				// Else we use the same queue
@@ -254,6 +272,7 @@ namespace vk {
 			if (result == VK_SUCCESS) {
 				// Create a default command pool for graphics command buffers
 				commandPool = createCommandPool(queueFamilyIndices.graphics);
+				allocator = new vk::MemoryAllocator(logicalDevice, physicalDevice);
 			}
 
 			return result;
@@ -308,27 +327,34 @@ namespace vk {
 		* @param buffer Pointer to a vk::Vulkan buffer object
 		* @param size Size of the buffer in byes
 		* @param data Pointer to the data that should be copied to the buffer after creation (optional, if not set, no data is copied over)
+		* @param sharedQueueFamilies (Optional) Queue family indices that access the buffer, if they differ the buffer is created with concurrent sharing
 		*
 		* @return VK_SUCCESS if buffer handle and memory have been created and (optionally passed) data has been copied
 		*/
-		VkResult createBuffer(VkBufferUsageFlags usageFlags, VkMemoryPropertyFlags memoryPropertyFlags, vk::Buffer *buffer, VkDeviceSize size, void *data = nullptr) {
+		VkResult createBuffer(VkBufferUsageFlags usageFlags, VkMemoryPropertyFlags memoryPropertyFlags, vk::Buffer *buffer, VkDeviceSize size, void *data = nullptr, std::vector<uint32_t> sharedQueueFamilies = {}) {
 			buffer->device = logicalDevice;
 
 			// Create the buffer handle
 			VkBufferCreateInfo bufferCreateInfo = vkTools::initializers::bufferCreateInfo(usageFlags, size);
+			std::sort(sharedQueueFamilies.begin(), sharedQueueFamilies.end());
+			sharedQueueFamilies.erase(std::unique(sharedQueueFamilies.begin(), sharedQueueFamilies.end()), sharedQueueFamilies.end());
+			if (sharedQueueFamilies.size() > 1) {
+				// Concurrent sharing avoids queue family ownership transfers between the queues using the buffer
+				bufferCreateInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+				bufferCreateInfo.queueFamilyIndexCount = static_cast<uint32_t>(sharedQueueFamilies.size());
+				bufferCreateInfo.pQueueFamilyIndices = sharedQueueFamilies.data();
+			}
 			VK_CHECK_RESULT(vkCreateBuffer(logicalDevice, &bufferCreateInfo, nullptr, &buffer->buffer));
 
-			// Create the memory backing up the buffer handle
+			// Sub-allocate the memory backing up the buffer handle from a block of a fitting memory type
 			VkMemoryRequirements memReqs;
-			VkMemoryAllocateInfo memAlloc = vkTools::initializers::memoryAllocateInfo();
 			vkGetBufferMemoryRequirements(logicalDevice, buffer->buffer, &memReqs);
-			memAlloc.allocationSize = memReqs.size;
-			// Find a memory type index that fits the properties of the buffer
-			memAlloc.memoryTypeIndex = getMemoryType(memReqs.memoryTypeBits, memoryPropertyFlags);
-			VK_CHECK_RESULT(vkAllocateMemory(logicalDevice, &memAlloc, nullptr, &buffer->memory));
+			VK_CHECK_RESULT(allocator->allocate(memReqs, memoryPropertyFlags, false, &buffer->allocation));
+			buffer->allocator = allocator;
+			buffer->memory = buffer->allocation.memory;
 
 			buffer->alignment = memReqs.alignment;
-			buffer->size = memAlloc.allocationSize;
+			buffer->size = memReqs.size;
 			buffer->usageFlags = usageFlags;
 			buffer->memoryPropertyFlags = memoryPropertyFlags;
 
@@ -346,6 +372,23 @@ namespace vk {
 			return buffer->bind();
 		}
 
+		/**
+		* Sub-allocate memory for an image and bind it
+		*
+		* @param image Image to allocate the memory for
+		* @param memoryPropertyFlags Memory properties for the image (i.e. device local)
+		* @param allocation Pointer to the allocation that has to be returned to allocator->free once the image is destroyed
+		* @param optimalTiling (Optional) Set to false for images with linear tiling
+		*
+		* @return VkResult of the bind call
+		*/
+		VkResult allocateImageMemory(VkImage image, VkMemoryPropertyFlags memoryPropertyFlags, vk::Allocation *allocation, bool optimalTiling = true) {
+			VkMemoryRequirements memReqs;
+			vkGetImageMemoryRequirements(logicalDevice, image, &memReqs);
+			VK_CHECK_RESULT(allocator->allocate(memReqs, memoryPropertyFlags, optimalTiling, allocation));
+			return vkBindImageMemory(logicalDevice, image, allocation->memory, allocation->offset);
+		}
+
 		/**
 		* Copy buffer data from src to dst using VkCmdCopyBuffer
 		*
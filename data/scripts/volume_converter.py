@@ -0,0 +1,64 @@
+import argparse
+import os
+import struct
+
+# converts a data set into the binary volume format (.vvol) loaded by the renderer
+# input is either a semicolon separated .txt volume (as written by datastructure_generator.py)
+# or a folder of slice images (the input of datastructure_generator.py, requires Pillow)
+
+MAGIC = b"VVOL"
+VERSION = 1
+VOXEL_TYPE_UINT8 = 0
+HEADER_FORMAT = "<4sI I 3I 3f 3f Q"
+HEADER_SIZE = struct.calcsize(HEADER_FORMAT)
+
+
+def write_header(out, dims, spacing, origin):
+    out.write(struct.pack(HEADER_FORMAT, MAGIC, VERSION, VOXEL_TYPE_UINT8, *dims, *spacing, *origin, HEADER_SIZE))
+
+
+def convert_txt(path, dims):
+    with open(path, "r") as text_file:
+        values = [int(v) for v in text_file.read().split(";") if v.strip()]
+    if dims is None:
+        side = round(len(values) ** (1.0 / 3.0))
+        dims = (side, side, side)
+    if dims[0] * dims[1] * dims[2] != len(values):
+        raise ValueError("%s contains %d voxels, expected %dx%dx%d" % (path, len(values), *dims))
+    if any(v < 0 or v > 255 for v in values):
+        raise ValueError("%s contains values outside of [0, 255]" % path)
+    return dims, bytes(values)
+
+
+def convert_slices(path, out, spacing, origin):
+    import PIL.Image as image
+
+    files = sorted(f for f in os.listdir(path) if os.path.isfile(os.path.join(path, f)))
+    dims = None
+    for file in files:
+        # transposed so that the image column is the fastest axis, which matches datastructure_generator.py
+        slice_image = image.open(os.path.join(path, file)).convert("L").transpose(image.TRANSPOSE)
+        if dims is None:
+            dims = (slice_image.size[0], slice_image.size[1], len(files))
+            write_header(out, dims, spacing, origin)
+        elif slice_image.size != (dims[0], dims[1]):
+            raise ValueError("slice %s has a different size than the first slice" % file)
+        # slices are streamed to the output, the whole volume never has to fit into memory
+        out.write(slice_image.tobytes())
+
+
+parser = argparse.ArgumentParser(description="Convert a volume data set to the binary .vvol format")
+parser.add_argument("input", help="semicolon separated .txt volume or folder of slice images")
+parser.add_argument("output", help="output .vvol file")
+parser.add_argument("--dims", type=int, nargs=3, help="dimensions of a .txt volume (default: cubic)")
+parser.add_argument("--spacing", type=float, nargs=3, default=(1.0, 1.0, 1.0), help="voxel spacing per axis")
+parser.add_argument("--origin", type=float, nargs=3, default=(0.0, 0.0, 0.0), help="position of the first voxel")
+args = parser.parse_args()
+
+with open(args.output, "wb") as out:
+    if os.path.isdir(args.input):
+        convert_slices(args.input, out, args.spacing, args.origin)
+    else:
+        dims, voxels = convert_txt(args.input, args.dims)
+        write_header(out, dims, args.spacing, args.origin)
+        out.write(voxels)